@@ -1,17 +1,50 @@
 typedef struct chunk_s chunk;
 
+// FIFO of chunks waiting to be fed to the decoder
 typedef struct chunk_tracker_s {
-    chunk *curchunk;
-    int pos;
+    chunk *curchunk; // head of the queue
+    chunk *tail;
+    int pos; // read position within curchunk
+    int count; // chunks in the queue
+    uint64_t bytes; // total size of the chunks in the queue
+    void (*watch)( void *opaque, chunk *c ); // sees every chunk as it is queued
+    void *watchOpaque;
+    char ended; // nothing more will be queued; the last picture need not wait for a NAL after it
 } chunk_tracker;
 
 struct chunk_s {
     char type;
     char easyType;
+    char refIdc; // nal_ref_idc; 0 when no other frame references this one
     char *data;
     char *rawptr;
     uint32_t size;
     chunk *next;
     int dtype;
     uint64_t time;
-};
\ No newline at end of file
+    uint32_t pad; // bytes after data + size that may be read, though they are not part of the NAL
+    char whole; // holds every slice of its picture, as queued from the warm start cache
+};
+
+#define CHUNK_PADDING 64 // slack left after NALs in buffers we allocate; see chunk__to_packet
+// Binary header sent ahead of a NAL in place of the 2 byte length and JSON header. The third
+// byte is never '{', so a receiver tells the two apart from the first bytes alone. Fields are
+// little endian on the wire, converted by chunk_header__swap; headerLen is where the NAL starts,
+// so later versions can append fields.
+#define CHUNK_MAGIC0 0xFF
+#define CHUNK_MAGIC1 'H'
+#define CHUNK_MAGIC2 'B'
+#define CHUNK_HEADER_VERSION 1
+
+#define CHUNK_FLAG_HEADER 1 // SPS, PPS or SEI
+#define CHUNK_FLAG_KEY 2 // IDR slice
+
+typedef struct chunk_header_s {
+    uint8_t magic[3];
+    uint8_t version;
+    uint16_t headerLen;
+    uint16_t flags;
+    uint32_t streamId;
+    uint32_t nalBytes;
+    uint64_t time; // producer ms
+} chunk_header;
@@ -0,0 +1,293 @@
+// Copyright (c) 2020 David Helkowski
+// Frame difference kernels
+//
+// Each sampled byte contributes difmap[ |a-b| >> 4 ] to the sum of the tile it falls in. The
+// SSE2 and AVX2 kernels compute exactly the same sums as the scalar one; the kernel is picked
+// at runtime by framedif_init. SSE2 has no byte shuffle, so it builds the difmap value from
+// compares; AVX2 looks it up with vpshufb.
+
+#ifndef __FRAMEDIF_H
+#define __FRAMEDIF_H
+#include<stdint.h>
+#include<stdlib.h>
+#include<string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h>
+#define FRAMEDIF_X86
+#endif
+
+#define TILE_SIZE 16 // matches the 16x16 MCU of 4:2:0 JPEG
+
+const uint8_t difmap[ 17 ] = {
+  0, // -16
+  1, // -32
+  3, // -48
+  10, // -64
+  10, // -80
+  20, // -96
+  20, // -112
+  40, // -128
+  40, // -144
+  80, // -160
+  80, // -176
+  160, // -192
+  160, // 208
+  255, // 224
+  255, // 240
+  255, // 256
+  255
+};
+
+typedef struct difconf_s {
+    int stride; // compare every Nth row
+    uint32_t threshold; // whole frame total that counts as a change
+    uint32_t tileThreshold; // tile total that marks the tile dirty
+} difconf;
+
+#define DIFCONF_DEFAULT { 3, 2500, 64 }
+
+// Per tile result of a comparison
+typedef struct tilemap_s {
+    int cols, rows;
+    int tw, th; // tile size in pixels
+    uint32_t *sums;
+    uint8_t *dirty;
+    int dirtyCount;
+    int *stack; // scratch for tilemap__regions
+} tilemap;
+
+// A rectangle of a frame in pixels
+typedef struct framerect_s {
+    int x, y, w, h;
+} framerect;
+
+tilemap *tilemap__new( int w, int h ) {
+    tilemap *self = calloc( sizeof( tilemap ), 1 );
+    self->tw = TILE_SIZE;
+    self->th = TILE_SIZE;
+    self->cols = ( w + TILE_SIZE - 1 ) / TILE_SIZE;
+    self->rows = ( h + TILE_SIZE - 1 ) / TILE_SIZE;
+    self->sums = calloc( sizeof( uint32_t ), self->cols * self->rows );
+    self->dirty = calloc( 1, self->cols * self->rows );
+    self->stack = calloc( sizeof( int ), self->cols * self->rows );
+    return self;
+}
+
+void tilemap__del( tilemap *self ) {
+    free( self->sums );
+    free( self->dirty );
+    free( self->stack );
+    free( self );
+}
+
+void tilemap__clear( tilemap *self ) {
+    memset( self->sums, 0, sizeof( uint32_t ) * self->cols * self->rows );
+    memset( self->dirty, 0, self->cols * self->rows );
+    self->dirtyCount = 0;
+}
+
+static char framerect__overlap( framerect *a, framerect *b ) {
+    return a->x < b->x + b->w && b->x < a->x + a->w && a->y < b->y + b->h && b->y < a->y + a->h;
+}
+
+// Bounding rectangles of groups of touching dirty tiles, clipped to a w x h frame. Rectangles
+// that overlap are merged so every pixel is covered once. Returns the number of rectangles, or
+// -1 when there would be more than max.
+int tilemap__regions( tilemap *self, int w, int h, framerect *rects, int max ) {
+    int cols = self->cols;
+    int rows = self->rows;
+    int count = 0;
+    
+    // Flood fill over 8 neighbours; visited dirty tiles are marked 2 until the end
+    for( int i=0;i<cols*rows && count >= 0;i++ ) {
+        if( self->dirty[i] != 1 ) continue;
+        if( count == max ) {
+            count = -1;
+            break;
+        }
+        int c0 = cols, r0 = rows, c1 = 0, r1 = 0;
+        int sp = 0;
+        self->stack[ sp++ ] = i;
+        self->dirty[i] = 2;
+        while( sp ) {
+            int t = self->stack[ --sp ];
+            int c = t % cols;
+            int r = t / cols;
+            if( c < c0 ) c0 = c;
+            if( c > c1 ) c1 = c;
+            if( r < r0 ) r0 = r;
+            if( r > r1 ) r1 = r;
+            for( int nr=r-1;nr<=r+1;nr++ ) {
+                if( nr < 0 || nr >= rows ) continue;
+                for( int nc=c-1;nc<=c+1;nc++ ) {
+                    if( nc < 0 || nc >= cols ) continue;
+                    int n = nr * cols + nc;
+                    if( self->dirty[n] != 1 ) continue;
+                    self->dirty[n] = 2;
+                    self->stack[ sp++ ] = n;
+                }
+            }
+        }
+        framerect *rect = &rects[ count++ ];
+        rect->x = c0;
+        rect->y = r0;
+        rect->w = c1 - c0 + 1;
+        rect->h = r1 - r0 + 1;
+    }
+    for( int i=0;i<cols*rows;i++ ) if( self->dirty[i] ) self->dirty[i] = 1;
+    if( count < 0 ) return -1;
+    
+    // Bounding boxes of separate groups can still overlap
+    for( int i=0;i<count;i++ ) {
+        for( int j=i+1;j<count;j++ ) {
+            framerect *a = &rects[i];
+            framerect *b = &rects[j];
+            if( !framerect__overlap( a, b ) ) continue;
+            int x1 = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+            int y1 = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+            if( b->x < a->x ) a->x = b->x;
+            if( b->y < a->y ) a->y = b->y;
+            a->w = x1 - a->x;
+            a->h = y1 - a->y;
+            rects[j] = rects[ --count ];
+            i = -1; // the grown rectangle may now overlap one already checked
+            break;
+        }
+    }
+    
+    // Tiles to pixels
+    for( int i=0;i<count;i++ ) {
+        framerect *rect = &rects[i];
+        rect->x *= self->tw;
+        rect->y *= self->th;
+        rect->w *= self->tw;
+        rect->h *= self->th;
+        if( rect->x + rect->w > w ) rect->w = w - rect->x;
+        if( rect->y + rect->h > h ) rect->h = h - rect->y;
+    }
+    return count;
+}
+
+// Add the difference of n bytes of a row into tileSums; tileBytes is a multiple of 16
+typedef void (*difrow_fn)( const uint8_t *a, const uint8_t *b, int n, int tileBytes, uint32_t *tileSums );
+
+static void difrow_scalar( const uint8_t *a, const uint8_t *b, int n, int tileBytes, uint32_t *tileSums ) {
+    for( int x=0;x<n;x++ ) {
+        tileSums[ x / tileBytes ] += difmap[ abs( a[x] - b[x] ) >> 4 ];
+    }
+}
+
+#ifdef FRAMEDIF_X86
+// difmap as a sum of steps: value = sum of delta[k] for every k where |a-b| >= edge[k]
+#define DIF_STEPS 8
+static const uint8_t difEdges[ DIF_STEPS ] = { 16, 32, 48, 80, 112, 144, 176, 208 };
+static const uint8_t difDeltas[ DIF_STEPS ] = { 1, 2, 7, 10, 20, 40, 80, 95 };
+
+// Starts at byte x so the AVX2 kernel can hand over its tail without shifting tile indexes
+__attribute__((target("sse2")))
+static void difrow_sse2_from( const uint8_t *a, const uint8_t *b, int x, int n, int tileBytes, uint32_t *tileSums ) {
+    __m128i zero = _mm_setzero_si128();
+    for( ;x + 16 <= n;x += 16 ) {
+        __m128i va = _mm_loadu_si128( (const __m128i *) &a[x] );
+        __m128i vb = _mm_loadu_si128( (const __m128i *) &b[x] );
+        __m128i d = _mm_or_si128( _mm_subs_epu8( va, vb ), _mm_subs_epu8( vb, va ) );
+        __m128i val = zero;
+        for( int k=0;k<DIF_STEPS;k++ ) {
+            __m128i edge = _mm_set1_epi8( (char) difEdges[k] );
+            __m128i ge = _mm_cmpeq_epi8( _mm_max_epu8( d, edge ), d );
+            val = _mm_add_epi8( val, _mm_and_si128( ge, _mm_set1_epi8( (char) difDeltas[k] ) ) );
+        }
+        __m128i sad = _mm_sad_epu8( val, zero );
+        tileSums[ x / tileBytes ] += _mm_cvtsi128_si32( sad ) + _mm_cvtsi128_si32( _mm_srli_si128( sad, 8 ) );
+    }
+    if( x < n ) {
+        uint32_t *tail = &tileSums[ x / tileBytes ];
+        for( ;x<n;x++ ) *tail += difmap[ abs( a[x] - b[x] ) >> 4 ];
+    }
+}
+
+static void difrow_sse2( const uint8_t *a, const uint8_t *b, int n, int tileBytes, uint32_t *tileSums ) {
+    difrow_sse2_from( a, b, 0, n, tileBytes, tileSums );
+}
+
+__attribute__((target("avx2")))
+static void difrow_avx2( const uint8_t *a, const uint8_t *b, int n, int tileBytes, uint32_t *tileSums ) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i low4 = _mm256_set1_epi8( 0x0F );
+    __m256i table = _mm256_broadcastsi128_si256( _mm_loadu_si128( (const __m128i *) difmap ) );
+    int x = 0;
+    for( ;x + 32 <= n;x += 32 ) {
+        __m256i va = _mm256_loadu_si256( (const __m256i *) &a[x] );
+        __m256i vb = _mm256_loadu_si256( (const __m256i *) &b[x] );
+        __m256i d = _mm256_or_si256( _mm256_subs_epu8( va, vb ), _mm256_subs_epu8( vb, va ) );
+        // |a-b| >> 4 is 0-15, so the first 16 difmap entries fit a single byte shuffle
+        __m256i idx = _mm256_and_si256( _mm256_srli_epi16( d, 4 ), low4 );
+        __m256i val = _mm256_shuffle_epi8( table, idx );
+        // four 64 bit sums; the low two cover bytes 0-15 and the high two bytes 16-31
+        __m256i sad = _mm256_sad_epu8( val, zero );
+        tileSums[ x / tileBytes ] += _mm256_extract_epi32( sad, 0 ) + _mm256_extract_epi32( sad, 2 );
+        tileSums[ ( x + 16 ) / tileBytes ] += _mm256_extract_epi32( sad, 4 ) + _mm256_extract_epi32( sad, 6 );
+    }
+    if( x < n ) difrow_sse2_from( a, b, x, n, tileBytes, tileSums );
+}
+#endif
+
+static difrow_fn difrow = difrow_scalar;
+
+// Pick the best kernel for this CPU. Returns the name of the kernel chosen.
+const char *framedif_init() {
+#ifdef FRAMEDIF_X86
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "avx2" ) ) {
+        difrow = difrow_avx2;
+        return "avx2";
+    }
+    if( __builtin_cpu_supports( "sse2" ) ) {
+        difrow = difrow_sse2;
+        return "sse2";
+    }
+#endif
+    difrow = difrow_scalar;
+    return "scalar";
+}
+
+// Compare a plane of two frames; bpp is 1 for luma and 3 for packed RGB. Returns 1 when the
+// total passes conf->threshold. With a map, every tile is summed and the ones over
+// conf->tileThreshold are marked dirty. Without a map the scan stops as soon as the total
+// passes the threshold.
+char framedif( uint8_t *p1, int l1, uint8_t *p2, int l2, int w, int h, int bpp, difconf *conf, tilemap *map ) {
+    int stride = conf->stride > 0 ? conf->stride : 1;
+    int tileBytes = TILE_SIZE * bpp;
+    int cols = ( w + TILE_SIZE - 1 ) / TILE_SIZE;
+    int rowBytes = w * bpp;
+    uint64_t totDif = 0;
+
+    if( !map ) {
+        uint32_t rowSums[ cols ];
+        memset( rowSums, 0, sizeof( rowSums ) );
+        for( int y=0;y<h;y+=stride ) {
+            difrow( p1 + l1 * y, p2 + l2 * y, rowBytes, tileBytes, rowSums );
+            for( int i=0;i<cols;i++ ) {
+                totDif += rowSums[i];
+                rowSums[i] = 0;
+            }
+            if( totDif > conf->threshold ) return 1;
+        }
+        return 0;
+    }
+
+    tilemap__clear( map );
+    for( int y=0;y<h;y+=stride ) {
+        difrow( p1 + l1 * y, p2 + l2 * y, rowBytes, tileBytes, &map->sums[ ( y / TILE_SIZE ) * map->cols ] );
+    }
+    int tiles = map->cols * map->rows;
+    for( int i=0;i<tiles;i++ ) {
+        totDif += map->sums[i];
+        if( map->sums[i] > conf->tileThreshold ) {
+            map->dirty[i] = 1;
+            map->dirtyCount++;
+        }
+    }
+    return totDif > conf->threshold;
+}
+#endif
@@ -7,7 +7,9 @@
 #include <stdio.h>
 
 #include <libavcodec/avcodec.h>
+#ifdef __APPLE__
 #include <libavcodec/videotoolbox.h>
+#endif
 #include <libavformat/avformat.h>
 #include <libavutil/pixdesc.h>
 #include <libavutil/hwcontext.h>
@@ -16,126 +18,445 @@
 #include <libavutil/imgutils.h>
 #include <libswscale/swscale.h>
 #include <turbojpeg.h>
+#ifdef __APPLE__
 #include <VideoToolbox/VideoToolbox.h>
+#endif
 #include <time.h>
 #include "uclop.h"
 #include <unistd.h>
+#include <errno.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include "ujsonin/ujsonin.h"
+#include "ring.h"
+#include "sps.h"
+#include "framedif.h"
+#include "pool.h"
 
 int64_t timespecDiff(struct timespec *timeA_p, struct timespec *timeB_p) {
   return ((timeA_p->tv_sec * 1000000000) + timeA_p->tv_nsec) - ((timeB_p->tv_sec * 1000000000) + timeB_p->tv_nsec);
 }
 
 #include "tracker.h"
+#include "mapreader.h"
+#include "keyindex.h"
+#include "warmcache.h"
 
-static enum AVPixelFormat hw_pix_fmt;
-
+// One device is shared by every decoder in the process
 static AVBufferRef *hw_device_ctx = NULL;
+static pthread_mutex_t hw_device_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static int hw_decoder_init(AVCodecContext *ctx, const enum AVHWDeviceType type) {
     int err = 0;
 
-    if( ( err = av_hwdevice_ctx_create(&hw_device_ctx, type, NULL, NULL, 0 ) ) < 0 ) {
+    pthread_mutex_lock( &hw_device_lock );
+    if( !hw_device_ctx && ( err = av_hwdevice_ctx_create(&hw_device_ctx, type, NULL, NULL, 0 ) ) < 0 ) {
+        pthread_mutex_unlock( &hw_device_lock );
         fprintf(stderr, "Failed to create specified HW device.\n");
         return err;
     }
     ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
+    pthread_mutex_unlock( &hw_device_lock );
 
     return err;
 }
 
+// The hw pixel format wanted is kept in ctx->opaque by setup_decoder
 static enum AVPixelFormat get_hw_format(AVCodecContext *ctx, const enum AVPixelFormat *pix_fmts) {
+    enum AVPixelFormat hw_pix_fmt = (enum AVPixelFormat) (intptr_t) ctx->opaque;
     const enum AVPixelFormat *p;
     for( p = pix_fmts; *p != -1; p++ ) if( *p == hw_pix_fmt ) return *p;
     fprintf(stderr, "Failed to get HW surface format.\n");
     return AV_PIX_FMT_NONE;
 }
 
+#ifdef __APPLE__
+#define DEFAULT_DECODER "videotoolbox"
+#else
+#define DEFAULT_DECODER "sw"
+#endif
+
+void list_hw_decoders() {
+    fprintf(stderr, "Available decoders: sw");
+    enum AVHWDeviceType type = AV_HWDEVICE_TYPE_NONE;
+    while( ( type = av_hwdevice_iterate_types( type ) ) != AV_HWDEVICE_TYPE_NONE ) {
+        fprintf(stderr, ", %s", av_hwdevice_get_type_name( type ) );
+    }
+    fprintf(stderr, "\n");
+}
+
+// Configure decoder_ctx for the chosen backend. "sw" uses the libavcodec software decoder with
+// frame and slice threading; anything else is looked up as a hw device type.
+int setup_decoder( AVCodecContext *decoder_ctx, AVCodec *decoder, char *backend ) {
+    if( !strcmp( backend, "sw" ) || !strcmp( backend, "software" ) ) {
+        decoder_ctx->thread_count = 0; // 0 lets libavcodec pick based on core count
+        decoder_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        printf("Using software decoder\n");
+        return 0;
+    }
+    
+    enum AVHWDeviceType type = av_hwdevice_find_type_by_name( backend );
+    if( type == AV_HWDEVICE_TYPE_NONE ) {
+        fprintf( stderr, "Cannot find %s hw decoder.\n", backend );
+        list_hw_decoders();
+        return -1;
+    }
+    
+    printf("Getting hardware config\n");
+    for( int i = 0;; i++ ) {
+        const AVCodecHWConfig *config = avcodec_get_hw_config( decoder, i );
+        if( !config ) {
+            fprintf(stderr, "Decoder %s does not support device type %s.\n", decoder->name, av_hwdevice_get_type_name(type));
+            return -1;
+        }
+        if( config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX && config->device_type == type ) {
+            decoder_ctx->opaque = (void *) (intptr_t) config->pix_fmt;
+            //const char *pixStr = av_get_pix_fmt_name( hw_pix_fmt );
+            //printf("Pixel format name: %s\n", pixStr );
+            break;
+        }
+    }
+    
+    decoder_ctx->get_format = get_hw_format;
+    
+    printf("Initiating %s decoder\n", backend );
+    return hw_decoder_init( decoder_ctx, type );
+}
+
+#define POOL_DEPTH 64
+
+// Recycled AVFrames. The frame structs are kept for reuse and picture buffers come from
+// AVBufferPools keyed by size, so after the first few frames nothing is allocated per frame.
+#define FRAME_POOL_SIZES 8 // decoder output, hw transfer and every rendition size
+typedef struct frame_pool_s {
+    objpool *shells;
+    AVBufferPool *bufs[ FRAME_POOL_SIZES ];
+    int bufSizes[ FRAME_POOL_SIZES ];
+    int nextSlot; // slot replaced when a new size is needed
+    pthread_mutex_t lock;
+} frame_pool;
+
+frame_pool *frame_pool__new() {
+    frame_pool *self = calloc( sizeof( frame_pool ), 1 );
+    self->shells = objpool__new( POOL_DEPTH );
+    pthread_mutex_init( &self->lock, NULL );
+    return self;
+}
+
+AVFrame *frame_pool__frame( frame_pool *self ) {
+    AVFrame *frame = objpool__get( self->shells );
+    if( !frame ) frame = av_frame_alloc();
+    return frame;
+}
+
+void frame_pool__put( frame_pool *self, AVFrame **frame ) {
+    if( !*frame ) return;
+    av_frame_unref( *frame ); // returns pooled buffers to their AVBufferPool
+    if( !objpool__put( self->shells, *frame ) ) av_frame_free( frame );
+    *frame = NULL;
+}
+
+// Give a blank frame a picture buffer from the pool. Returns 0 on success.
+int frame_pool__get_buffer( frame_pool *self, AVFrame *frame, int fmt, int w, int h ) {
+    int size = av_image_get_buffer_size( fmt, w, h, 32 );
+    if( size < 0 ) return size;
+    
+    pthread_mutex_lock( &self->lock );
+    AVBufferPool *pool = NULL;
+    for( int i=0;i<FRAME_POOL_SIZES;i++ ) {
+        if( self->bufs[i] && self->bufSizes[i] == size ) pool = self->bufs[i];
+    }
+    if( !pool ) {
+        // Buffers still out from a replaced pool are freed once they are all returned
+        int slot = self->nextSlot;
+        self->nextSlot = ( slot + 1 ) % FRAME_POOL_SIZES;
+        if( self->bufs[ slot ] ) av_buffer_pool_uninit( &self->bufs[ slot ] );
+        pool = self->bufs[ slot ] = av_buffer_pool_init( size, NULL );
+        self->bufSizes[ slot ] = size;
+    }
+    pthread_mutex_unlock( &self->lock );
+    
+    frame->buf[0] = av_buffer_pool_get( pool );
+    if( !frame->buf[0] ) return AVERROR(ENOMEM);
+    frame->format = fmt;
+    frame->width = w;
+    frame->height = h;
+    return av_image_fill_arrays( frame->data, frame->linesize, frame->buf[0]->data, fmt, w, h, 32 ) < 0 ? -1 : 0;
+}
+
+void frame_pool__del( frame_pool *self ) {
+    AVFrame *frame;
+    while( ( frame = objpool__get( self->shells ) ) ) av_frame_free( &frame );
+    objpool__del( self->shells );
+    for( int i=0;i<FRAME_POOL_SIZES;i++ ) if( self->bufs[i] ) av_buffer_pool_uninit( &self->bufs[i] );
+    pthread_mutex_destroy( &self->lock );
+    free( self );
+}
+
+typedef struct jpeg_pool_s jpeg_pool;
+
 typedef struct myjpeg_s {
     unsigned char *data;
     long unsigned int size;
+    framerect rect; // part of the frame this jpeg covers
+    int64_t frameNum; // position of the frame in the stream, from its pts
+    int rend; // rendition of frame_prep the jpeg was encoded for
+    struct myjpeg_s *next; // further regions of the same frame
+    jpeg_pool *pool; // where the jpeg goes back to when done; NULL to free it
+    long unsigned int cap; // allocated size of data
 } myjpeg;
 
-myjpeg *raw_to_jpeg( tjhandle compressor, unsigned char * buffer, int w, int h, const char* outfilename, int linesize );
-void send_jpeg( myjpeg *jpeg, myzmq *dest );
+// JPEG output buffers sized with tjBufSize for the largest frame of a stream, so libjpeg-turbo
+// can write into them with TJFLAG_NOREALLOC
+struct jpeg_pool_s {
+    objpool *free;
+    long unsigned int cap;
+};
+
+jpeg_pool *jpeg_pool__new( int w, int h, int samp ) {
+    jpeg_pool *self = calloc( sizeof( jpeg_pool ), 1 );
+    self->free = objpool__new( POOL_DEPTH );
+    self->cap = tjBufSize( w, h, samp );
+    return self;
+}
+
+myjpeg *jpeg_pool__get( jpeg_pool *self ) {
+    myjpeg *jpeg = objpool__get( self->free );
+    if( !jpeg ) {
+        jpeg = calloc( sizeof( myjpeg ), 1 );
+        jpeg->data = tjAlloc( self->cap );
+        jpeg->cap = self->cap;
+        jpeg->pool = self;
+    }
+    jpeg->size = 0;
+    jpeg->next = NULL;
+    jpeg->rend = 0;
+    return jpeg;
+}
+
+void myjpeg__del( myjpeg *self ) {
+    if( self->pool && objpool__put( self->pool->free, self ) ) return;
+    tjFree( self->data );
+    free( self );
+}
+
+void jpeg_pool__del( jpeg_pool *self ) {
+    myjpeg *jpeg;
+    while( ( jpeg = objpool__get( self->free ) ) ) {
+        tjFree( jpeg->data );
+        free( jpeg );
+    }
+    objpool__del( self->free );
+    free( self );
+}
 
 char strErr[200];
 
-int skip_frame( AVCodecContext *avctx, AVPacket *packet ) {
-    int ret = avcodec_send_packet(avctx, packet);
-    if (ret < 0) {
-        av_strerror( ret, strErr, 200 );
-        fprintf(stderr, "Error during decoding: %s\n", strErr);
-        goto SKIPFAIL;
+// SwsContext cache; lives as long as the stream and is only rebuilt when the geometry changes
+typedef struct scaler_s {
+    struct SwsContext *ctx;
+    int sw, sh, sfmt;
+    int dw, dh, dfmt;
+    int flags;
+} scaler;
+
+struct SwsContext *scaler__get( scaler *self, int sw, int sh, int sfmt, int dw, int dh, int dfmt, int flags ) {
+    if( self->ctx &&
+        self->sw == sw && self->sh == sh && self->sfmt == sfmt &&
+        self->dw == dw && self->dh == dh && self->dfmt == dfmt &&
+        self->flags == flags ) return self->ctx;
+    
+    if( self->ctx ) {
+        printf("Scaler input changed to %i x %i ( %s ); rebuilding\n", sw, sh, av_get_pix_fmt_name( sfmt ) );
+        sws_freeContext( self->ctx );
     }
-    AVFrame *frame = av_frame_alloc();
-    if( !frame ) {
-        fprintf(stderr, "Cannot alloc frame\n");
-        goto SKIPFAIL;
+    self->ctx = sws_getContext( sw, sh, sfmt, dw, dh, dfmt, flags, NULL, NULL, NULL );
+    self->sw = sw; self->sh = sh; self->sfmt = sfmt;
+    self->dw = dw; self->dh = dh; self->dfmt = dfmt;
+    self->flags = flags;
+    return self->ctx;
+}
+
+void scaler__del( scaler *self ) {
+    if( self->ctx ) sws_freeContext( self->ctx );
+    self->ctx = NULL;
+}
+
+#define DEFAULT_JPEG_QUALITY 75
+#define MAX_RENDITIONS 4
+
+// One output size and jpeg encoding of a stream. Renditions are kept largest first; the first
+// is what prepare_frame scales to and compares, and each further one is scaled from the one
+// before it, so every scale after the first works on an already reduced frame.
+typedef struct rendition_s {
+    int id; // position in --renditions; sent as "r" in the jpeg header
+    int dw, dh;
+    int quality;
+    int samp; // TJSAMP_420, TJSAMP_422, TJSAMP_444 or TJSAMP_GRAY
+    scaler scale; // from the rendition before this one
+    jpeg_pool *jpegs;
+} rendition;
+
+// Planar format a rendition is scaled to; gray jpegs only read the luma plane
+static int samp__pix_fmt( int samp ) {
+    if( samp == TJSAMP_444 ) return AV_PIX_FMT_YUV444P;
+    if( samp == TJSAMP_422 ) return AV_PIX_FMT_YUV422P;
+    return AV_PIX_FMT_YUV420P;
+}
+
+// Chroma plane shifts of the planar formats above
+static void pix_fmt__shift( int fmt, int *sx, int *sy ) {
+    *sx = fmt == AV_PIX_FMT_YUV444P ? 0 : 1;
+    *sy = ( fmt == AV_PIX_FMT_YUV444P || fmt == AV_PIX_FMT_YUV422P ) ? 0 : 1;
+}
+
+// Parse --renditions: comma separated WxH[:quality[:subsampling]], ex: 1280x720:80,320x180:60:gray
+// Subsampling is 420 ( default ), 422, 444 or gray. Returns the count, sorted largest first, or
+// 0 when the spec is bad.
+int renditions__parse( char *spec, rendition *list ) {
+    int count = 0;
+    char *pos = spec;
+    while( *pos ) {
+        if( count == MAX_RENDITIONS ) {
+            fprintf(stderr, "At most %i renditions\n", MAX_RENDITIONS );
+            return 0;
+        }
+        rendition *r = &list[ count ];
+        memset( r, 0, sizeof( rendition ) );
+        r->id = count;
+        r->quality = DEFAULT_JPEG_QUALITY;
+        r->samp = TJSAMP_420;
+        char samp[8] = { 0 };
+        int used = 0;
+        int got = sscanf( pos, "%ix%i%n:%i%n:%7[a-z0-9]%n", &r->dw, &r->dh, &used, &r->quality, &used, samp, &used );
+        // 4:2:0 planes need even sizes
+        r->dw &= ~1;
+        r->dh &= ~1;
+        if( got < 2 || r->dw <= 0 || r->dh <= 0 || r->quality < 1 || r->quality > 100 ) {
+            fprintf(stderr, "Bad rendition %s\n", pos );
+            return 0;
+        }
+        if( got == 4 ) {
+            if( !strcmp( samp, "422" ) ) r->samp = TJSAMP_422;
+            else if( !strcmp( samp, "444" ) ) r->samp = TJSAMP_444;
+            else if( !strcmp( samp, "gray" ) ) r->samp = TJSAMP_GRAY;
+            else if( strcmp( samp, "420" ) ) {
+                fprintf(stderr, "Unknown subsampling %s\n", samp );
+                return 0;
+            }
+        }
+        count++;
+        pos += used;
+        if( *pos == ',' ) pos++;
+        else if( *pos ) {
+            fprintf(stderr, "Bad rendition %s\n", pos );
+            return 0;
+        }
     }
-    ret = avcodec_receive_frame( avctx, frame );
-    if( ret < 0 ) {
-        av_strerror( ret, strErr, 200 );
-        fprintf(stderr, "Error recv frame: %s\n", strErr);
-        goto SKIPFAIL;
+    for( int i=1;i<count;i++ ) {
+        for( int j=i;j>0 && list[j].dw * list[j].dh > list[j-1].dw * list[j-1].dh;j-- ) {
+            rendition tmp = list[j];
+            list[j] = list[j-1];
+            list[j-1] = tmp;
+        }
     }
-    av_packet_unref( packet );
-    return 1;
-  SKIPFAIL:
-    av_packet_unref( packet );
-    return 0;
+    return count;
 }
 
-const uint8_t difmap[ 17 ] = {
-  0, // -16
-  1, // -32
-  3, // -48
-  10, // -64
-  10, // -80
-  20, // -96
-  20, // -112
-  40, // -128
-  40, // -144
-  80, // -160
-  80, // -176
-  160, // -192
-  160, // 208 
-  255, // 224
-  255, // 240
-  255, // 256
-  255
-};
+// Luma plane of YUV frames
+// Pass a map to get per tile results; without one the scan stops early once the frame counts as changed
+char frameDifLuma( AVFrame *f1, AVFrame *f2, difconf *conf, tilemap *map ) {
+    return framedif( f1->data[0], f1->linesize[0], f2->data[0], f2->linesize[0], f1->width, f1->height, 1, conf, map );
+}
 
-char frameDif( AVFrame *f1, AVFrame *f2 ) {
-    int w = f1->width*3;
-    int h = f1->height;
-    int l1 = f1->linesize[0];
-    uint64_t totDif = 0;
-    for( int y=0;y<h;y++ ) {
-        if( y%3 ) continue;
-        int lstart = l1 * y;
-        uint8_t *d1 = f1->data[0] + lstart;
-        uint8_t *d2 = f2->data[0] + lstart;
-        for( int x=0;x<w;x+=9,d1+=9,d2+=9 ) {
-            uint8_t r1 = *d1;
-            uint8_t g1 = *(d1+1);
-            uint8_t b1 = *(d1+2);
-            uint8_t r2 = *d2;
-            uint8_t g2 = *(d2+1);
-            uint8_t b2 = *(d2+2);
-            
-            uint8_t dr = abs( r1-r2 ) >> 4; 
-            uint8_t dg = abs( g1-g2 ) >> 4;
-            uint8_t db = abs( b1-b2 ) >> 4;
-            
-            totDif += difmap[dr] + difmap[dg] + difmap[db];
+// Scaling and change detection state for a stream
+typedef struct frame_prep_s {
+    scaler scale;
+    AVFrame *prevframe;
+    uint64_t prevtime; // producer time of the last whole frame sent
+    int dw, dh;
+    difconf dif;
+    tilemap *map; // dirty tiles of the last frame compared; only kept in region mode
+    char regions; // send changed regions instead of whole frames
+    char all; // skip change detection and keep every frame
+    uint64_t keyInterval; // ms after which a whole frame is sent even if nothing changed; 0 for never
+    frame_pool *frames; // every frame of the stream comes from and goes back to this
+    rendition rends[ MAX_RENDITIONS ]; // the first is dw x dh
+    int rendCount;
+} frame_prep;
+
+void frame_prep__init( frame_prep *self, int dw, int dh, difconf *dif, char regions ) {
+    memset( self, 0, sizeof( frame_prep ) );
+    self->dw = dw;
+    self->dh = dh;
+    self->dif = *dif;
+    self->regions = regions;
+    self->keyInterval = 1000;
+    self->frames = frame_pool__new();
+    rendition *r = &self->rends[0];
+    r->dw = dw;
+    r->dh = dh;
+    r->quality = DEFAULT_JPEG_QUALITY;
+    r->samp = TJSAMP_420;
+    if( dw && dh ) r->jpegs = jpeg_pool__new( dw, dh, r->samp );
+    self->rendCount = 1;
+}
+
+// Use the renditions from renditions__parse in place of the single dw x dh one
+void frame_prep__set_renditions( frame_prep *self, rendition *list, int count ) {
+    if( self->rends[0].jpegs ) jpeg_pool__del( self->rends[0].jpegs );
+    for( int i=0;i<count;i++ ) {
+        rendition *r = &self->rends[i];
+        *r = list[i];
+        r->jpegs = jpeg_pool__new( r->dw, r->dh, r->samp );
+        printf("Rendition %i: %i x %i, quality %i\n", r->id, r->dw, r->dh, r->quality );
+    }
+    self->rendCount = count;
+    self->dw = self->rends[0].dw;
+    self->dh = self->rends[0].dh;
+}
+
+// Regions of a frame that changed; a count of 0 means the whole frame
+#define MAX_REGIONS 16
+typedef struct region_update_s {
+    int count;
+    framerect rects[ MAX_REGIONS ];
+} region_update;
+
+myjpeg *encode_update( tjhandle compressor, AVFrame *frame, region_update *update, rendition *rend, int index );
+
+// Copy one rectangle of a planar YUV frame. x and y are even since rects are tile aligned.
+static void frame__copy_rect( AVFrame *dst, AVFrame *src, framerect *rect ) {
+    int sx, sy;
+    pix_fmt__shift( dst->format, &sx, &sy );
+    for( int p=0;p<3;p++ ) {
+        int shiftx = p ? sx : 0;
+        int shifty = p ? sy : 0;
+        int x = rect->x >> shiftx;
+        int y = rect->y >> shifty;
+        int w = ( rect->w + shiftx ) >> shiftx;
+        int h = ( rect->h + shifty ) >> shifty;
+        for( int row=y;row<y+h;row++ ) {
+            memcpy( dst->data[p] + dst->linesize[p] * row + x, src->data[p] + src->linesize[p] * row + x, w );
         }
-        if( totDif > 2500 ) return 1;
     }
-    //printf("dif: %lli\n", (long long ) totDif );
-    if( totDif > 2500 ) return 1;
-    return 0;
+}
+
+void frame_prep__free( frame_prep *self ) {
+    scaler__del( &self->scale );
+    if( self->frames ) {
+        frame_pool__put( self->frames, &self->prevframe );
+        frame_pool__del( self->frames );
+    }
+    for( int i=0;i<self->rendCount;i++ ) {
+        rendition *r = &self->rends[i];
+        scaler__del( &r->scale );
+        if( r->jpegs ) jpeg_pool__del( r->jpegs );
+        r->jpegs = NULL;
+    }
+    if( self->map ) tilemap__del( self->map );
+    self->map = NULL;
+    self->frames = NULL;
 }
 
 void get_frame_size( AVCodecContext *avctx, AVPacket *packet, int *w, int *h ) {
@@ -155,6 +476,10 @@ void get_frame_size( AVCodecContext *avctx, AVPacket *packet, int *w, int *h ) {
     }
     
     ret = avcodec_receive_frame(avctx, frame);
+    if( ret < 0 ) {
+        av_frame_free(&frame);
+        return;
+    }
     
     *w = frame->width;
     *h = frame->height;
@@ -162,233 +487,1382 @@ void get_frame_size( AVCodecContext *avctx, AVPacket *packet, int *w, int *h ) {
     av_frame_free(&frame);
 }
 
-myjpeg *process_frame( tjhandle compressor, AVCodecContext *avctx, AVPacket *packet, uint64_t frameTime, char skip, AVFrame **prevframe, uint64_t *prevtime, int dw, int dh ) {
-    int size;
+// Take the next frame out of the decoder, in system memory, or NULL when there is none to use.
+// The returned frame comes from pool and goes back to it with frame_pool__put.
+AVFrame *receive_frame( AVCodecContext *avctx, frame_pool *pool ) {
+    AVFrame *frame = frame_pool__frame( pool );
+    if( !frame ) {
+        fprintf(stderr, "Can not alloc frame\n");
+        return NULL;
+    }
+    
+    int ret = avcodec_receive_frame(avctx, frame);
+    
+    if( ret < 0 ) {
+        frame_pool__put( pool, &frame );
+        // A frame threaded decoder holds back output until its threads are primed
+        if( ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ) return NULL;
+        av_strerror( ret, strErr, 200 );
+        fprintf(stderr, "Error while decoding: %s\n", strErr);
+        return NULL;
+    }
+    
+    // Frames from a hw decoder live in device memory; software decoded frames can be used as is
+    if( frame->hw_frames_ctx ) {
+        AVFrame *frame2 = frame_pool__frame( pool );
+        AVHWFramesContext *hwfc = ( AVHWFramesContext * ) frame->hw_frames_ctx->data;
+        if( frame_pool__get_buffer( pool, frame2, hwfc->sw_format, frame->width, frame->height ) ) {
+            av_frame_unref( frame2 ); // let the transfer allocate instead
+        }
+        av_hwframe_transfer_data( frame2, frame, 0 );
+        frame2->pts = frame->pts;
+        frame_pool__put( pool, &frame );
+        return frame2;
+    }
+    
+    /*CVPixelBufferRef pix_buf = (CVPixelBufferRef)frame2->data[3];
+    OSType pixel_format = CVPixelBufferGetPixelFormatType(pix_buf);
+    const char *pixStr = av_get_pix_fmt_name( pixel_format );
+    printf("Decoded Pixel format: %s\n", pixStr );*/
+    
+    return frame;
+}
+
+AVFrame *decode_frame( AVCodecContext *avctx, AVPacket *packet, frame_pool *pool ) {
     int ret = avcodec_send_packet(avctx, packet);
     if (ret < 0) {
         av_strerror( ret, strErr, 200 );
         fprintf(stderr, "Error during decoding: %s\n", strErr);
-        goto fail;
+        return NULL;
     }
+    return receive_frame( avctx, pool );
+}
 
-    AVFrame *frame = av_frame_alloc();
-    AVFrame *frame2 = av_frame_alloc();
-    if( !frame || !frame2 ) {
-        fprintf(stderr, "Can not alloc frame\n");
-        ret = AVERROR(ENOMEM);
-        goto fail;
+// Scale a decoded frame to the target size and compare it to the previous frame. Returns the
+// frame to encode, or NULL when it is not different enough from the last one sent.
+//
+// Normally prevframe keeps its own reference to the returned frame. In region mode prevframe is
+// a private copy of what the receiver has; only the regions listed in update are copied into it,
+// so changes too small to send keep adding up until their tiles are sent. Whole frames still go
+// out at least once every keyInterval ms of producer time.
+AVFrame *prepare_frame( frame_prep *prep, AVFrame *sysframe, uint64_t frameTime, region_update *update ) {
+    scaler *scale = &prep->scale;
+    AVFrame **prevframe = &prep->prevframe;
+    uint64_t *prevtime = &prep->prevtime;
+    int dw = prep->dw;
+    int dh = prep->dh;
+    int w = sysframe->width;
+    int h = sysframe->height;
+    if( !dw ) {
+        dw = w;
+        dh = h;
     }
     
-    ret = avcodec_receive_frame(avctx, frame);
+    // libjpeg-turbo takes YUV planes directly, so the frame stays in YUV the whole way. When
+    // the decoder already outputs the planar format at the target size no conversion is needed.
+    AVFrame *frame3 = frame_pool__frame( prep->frames );
+    int fmt = sysframe->format;
+    int pfmt = samp__pix_fmt( prep->rends[0].samp );
+    if( dw == w && dh == h && ( fmt == pfmt || ( fmt == AV_PIX_FMT_YUVJ420P && pfmt == AV_PIX_FMT_YUV420P ) ) ) {
+        av_frame_ref( frame3, sysframe );
+    }
+    else {
+        struct SwsContext *sws_ctx = scaler__get( scale,
+            w, h, fmt,
+            dw, dh, pfmt,
+            SWS_POINT );
+        
+        frame_pool__get_buffer( prep->frames, frame3, pfmt, dw, dh );
+        
+        int resultHeight = sws_scale( sws_ctx,
+            (const uint8_t *const *) sysframe->data, sysframe->linesize, 0, h,
+            frame3->data, frame3->linesize );
+        
+        if( resultHeight != dh ) {
+            fprintf(stderr, "Result height %i doesn't match destination height %i\n", resultHeight, dh );
+        }
+        frame3->pts = sysframe->pts;
+    }
+    update->count = 0;
+    if( prep->all ) return frame3;
+    
+    if( *prevframe && ( (*prevframe)->width != dw || (*prevframe)->height != dh || (*prevframe)->format != frame3->format ) ) frame_pool__put( prep->frames, prevframe );
+    if( prep->regions && ( !prep->map || prep->map->cols != ( dw + TILE_SIZE - 1 ) / TILE_SIZE || prep->map->rows != ( dh + TILE_SIZE - 1 ) / TILE_SIZE ) ) {
+        if( prep->map ) tilemap__del( prep->map );
+        prep->map = tilemap__new( dw, dh );
+    }
+    
+    if( *prevframe ) {
+        char needFrame = 0;
+        // frameTime is the producer time; without one ( raw files, avformat demux ) there is no
+        // interval to keep
+        if( prep->keyInterval && frameTime && *prevtime && frameTime > *prevtime + prep->keyInterval ) {
+            needFrame = 1;
+        }
+        char changed = frameDifLuma( frame3, *prevframe, &prep->dif, prep->map );
+        if( prep->regions ) changed = prep->map->dirtyCount > 0;
+        if( !changed && !needFrame ) {
+            frame_pool__put( prep->frames, &frame3 );
+            //printf("Unchanged\n");
+            return NULL;
+        }
+        if( prep->regions && !needFrame ) {
+            int count = tilemap__regions( prep->map, dw, dh, update->rects, MAX_REGIONS );
+            int area = 0;
+            for( int i=0;i<count;i++ ) area += update->rects[i].w * update->rects[i].h;
+            // Past half the frame one whole jpeg is smaller than the pieces
+            if( count > 0 && area < dw * dh / 2 ) {
+                update->count = count;
+                for( int i=0;i<count;i++ ) frame__copy_rect( *prevframe, frame3, &update->rects[i] );
+                return frame3;
+            }
+        }
+        if( !prep->regions ) frame_pool__put( prep->frames, prevframe );
+    }
+    if( prep->regions ) {
+        if( !*prevframe ) {
+            *prevframe = frame_pool__frame( prep->frames );
+            frame_pool__get_buffer( prep->frames, *prevframe, frame3->format, dw, dh );
+        }
+        av_frame_copy( *prevframe, frame3 );
+    }
+    else {
+        *prevframe = frame_pool__frame( prep->frames );
+        av_frame_ref( *prevframe, frame3 );
+    }
+    *prevtime = frameTime;
     
-    if( skip ) {
-        /*uint64_t now = now_msec();
-        uint64_t dif = now - frameTime;
-        printf("MS till drop: %lli\n", (long long) dif );*/
-        if( frame ) av_frame_free(&frame);
-        if( frame2 ) av_frame_free(&frame2);
+    return frame3;
+}
+
+// Scale rendition i from from, the frame of the rendition before it. The returned frame comes
+// from the frame pool.
+AVFrame *rendition__scale( frame_prep *prep, int i, AVFrame *from ) {
+    rendition *r = &prep->rends[i];
+    int fmt = samp__pix_fmt( r->samp );
+    struct SwsContext *sws_ctx = scaler__get( &r->scale,
+        from->width, from->height, from->format,
+        r->dw, r->dh, fmt,
+        SWS_FAST_BILINEAR );
+    AVFrame *frame = frame_pool__frame( prep->frames );
+    frame_pool__get_buffer( prep->frames, frame, fmt, r->dw, r->dh );
+    sws_scale( sws_ctx, (const uint8_t *const *) from->data, from->linesize, 0, from->height, frame->data, frame->linesize );
+    frame->pts = from->pts;
+    return frame;
+}
+
+// Prepare and encode a decoded frame; NULL when the frame is unchanged or nothing could be
+// encoded. Takes the frame. With several renditions the chain holds the jpegs of the first
+// followed by one per other.
+myjpeg *process_frame( tjhandle compressor, frame_prep *prep, AVFrame *sysframe, uint64_t frameTime ) {
+    region_update update;
+    AVFrame *frame3 = prepare_frame( prep, sysframe, frameTime, &update );
+    frame_pool__put( prep->frames, &sysframe );
+    if( !frame3 ) return NULL;
+    
+    myjpeg *jpeg = encode_update( compressor, frame3, &update, &prep->rends[0], 0 );
+    myjpeg **next = &jpeg;
+    for( int i=1;i<prep->rendCount;i++ ) {
+        AVFrame *frame = rendition__scale( prep, i, frame3 );
+        frame_pool__put( prep->frames, &frame3 );
+        frame3 = frame;
+        
+        region_update whole = { 0 };
+        while( *next ) next = &(*next)->next;
+        *next = encode_update( compressor, frame3, &whole, &prep->rends[i], i );
+    }
+    frame_pool__put( prep->frames, &frame3 );
+    return jpeg;
+}
+
+// Encode one rectangle of a planar YUV frame by pointing the planes at its top left corner.
+// rend gives the quality and subsampling, defaults without one. With a pool the jpeg is written
+// straight into a pooled buffer. NULL when compression fails.
+myjpeg *yuv_rect_to_jpeg( tjhandle compressor, AVFrame *frame, framerect *rect, rendition *rend ) {
+    int quality = rend ? rend->quality : DEFAULT_JPEG_QUALITY;
+    int samp = rend ? rend->samp : TJSAMP_420;
+    jpeg_pool *pool = rend ? rend->jpegs : NULL;
+    int flags = TJFLAG_FASTDCT;
+    myjpeg *jpeg;
+    if( pool && pool->cap >= tjBufSize( rect->w, rect->h, samp ) ) {
+        jpeg = jpeg_pool__get( pool );
+        jpeg->size = jpeg->cap;
+        flags |= TJFLAG_NOREALLOC;
+    }
+    else {
+        jpeg = calloc( sizeof( myjpeg ), 1 );
+    }
+    jpeg->rect = *rect;
+    jpeg->frameNum = frame->pts;
+    
+    int sx, sy;
+    pix_fmt__shift( frame->format, &sx, &sy );
+    const unsigned char *planes[3] = {
+        frame->data[0] + frame->linesize[0] * rect->y + rect->x,
+        frame->data[1] + frame->linesize[1] * ( rect->y >> sy ) + ( rect->x >> sx ),
+        frame->data[2] + frame->linesize[2] * ( rect->y >> sy ) + ( rect->x >> sx )
+    };
+    int strides[3] = { frame->linesize[0], frame->linesize[1], frame->linesize[2] };
+    
+    int res = tjCompressFromYUVPlanes( compressor, planes, rect->w, strides, rect->h, samp, &jpeg->data, &jpeg->size, quality, flags );
+    if( res == -1 ) {
+        fprintf(stderr, "tjCompressFromYUVPlanes failed: %s\n", tjGetErrorStr() );
+        jpeg->size = 0;
+        myjpeg__del( jpeg );
         return NULL;
     }
+    return jpeg;
+}
+
+// One jpeg for the whole frame, or a chain with one jpeg per changed region. index is the
+// position of rend in frame_prep; the jpegs are marked with it. Regions that fail to compress are
+// left out, so the result is NULL when all of them do.
+myjpeg *encode_update( tjhandle compressor, AVFrame *frame, region_update *update, rendition *rend, int index ) {
+    if( !update->count ) {
+        framerect all = { 0, 0, frame->width, frame->height };
+        myjpeg *jpeg = yuv_rect_to_jpeg( compressor, frame, &all, rend );
+        if( jpeg ) jpeg->rend = index;
+        return jpeg;
+    }
+    myjpeg *first = NULL;
+    myjpeg **next = &first;
+    for( int i=0;i<update->count;i++ ) {
+        *next = yuv_rect_to_jpeg( compressor, frame, &update->rects[i], rend );
+        if( !*next ) continue;
+        (*next)->rend = index;
+        next = &(*next)->next;
+    }
+    return first;
+}
+
+void write_jpeg( myjpeg *jpeg, char *filename ) {
+    if( filename ) {
+        FILE *fh = fopen( filename, "wb" );
+        if( !fh ) {
+            fprintf(stderr,"Can't open %s for writing\n", filename );
+            myjpeg__del( jpeg );
+            return;
+        }
+        fwrite( jpeg->data, 1, jpeg->size, fh );
+        fclose( fh );
+    }
+    myjpeg__del( jpeg );
+}
+
+// Every jpeg of a batch run, either as numbered files in a directory or appended to one archive.
+// The archive gets a text index beside it with a "frame offset size" line per jpeg.
+typedef struct batch_output_s {
+    char *dir;
+    FILE *archive;
+    FILE *index;
+    uint64_t offset;
+    int written;
+    int firstFrame; // frames this run covers; endFrame 0 for the end of the file
+    int endFrame;
+    keyentry *seek; // keyframe to start decoding at; NULL for the start of the file
+    int encoders; // encoder threads when --encoders is not given
+} batch_output;
+
+// Make the output dir unless it is there already; 0 when that fails
+static char batch_output__mkdir( char *dir ) {
+    if( !mkdir( dir, 0755 ) || errno == EEXIST ) return 1;
+    fprintf(stderr, "Can't create output dir %s; %s\n", dir, strerror( errno ) );
+    return 0;
+}
+
+batch_output *batch_output__new( char *dir, char *archive ) {
+    batch_output *self = calloc( sizeof( batch_output ), 1 );
+    if( archive ) {
+        self->archive = fopen( archive, "wb" );
+        char indexFile[300];
+        snprintf( indexFile, 300, "%s.index", archive );
+        self->index = fopen( indexFile, "w" );
+        if( !self->archive || !self->index ) {
+            fprintf(stderr, "Can't open %s or %s for writing\n", archive, indexFile );
+            if( self->archive ) fclose( self->archive );
+            if( self->index ) fclose( self->index );
+            free( self );
+            return NULL;
+        }
+        printf("Writing jpegs to archive %s, index %s\n", archive, indexFile );
+        return self;
+    }
+    self->dir = dir ? dir : ".";
+    if( !batch_output__mkdir( self->dir ) ) {
+        free( self );
+        return NULL;
+    }
+    printf("Writing jpegs to %s\n", self->dir );
+    return self;
+}
+
+void batch_output__write( batch_output *self, myjpeg *jpeg ) {
+    if( self->archive ) {
+        fwrite( jpeg->data, 1, jpeg->size, self->archive );
+        fprintf( self->index, "%lld %llu %lu\n", (long long) jpeg->frameNum, (unsigned long long) self->offset, jpeg->size );
+        self->offset += jpeg->size;
+        self->written++;
+        myjpeg__del( jpeg );
+        return;
+    }
+    char filename[300];
+    snprintf( filename, 300, "%s/%08lld.jpg", self->dir, (long long) jpeg->frameNum );
+    write_jpeg( jpeg, filename );
+    self->written++;
+}
+
+void batch_output__del( batch_output *self ) {
+    if( self->archive ) fclose( self->archive );
+    if( self->index ) fclose( self->index );
+    free( self );
+}
+
+static void myjpeg__zmq_free( void *data, void *hint ) {
+    myjpeg__del( (myjpeg *) hint );
+}
+
+// The header and the jpeg go out as two parts of one message. The jpeg buffer goes out as is;
+// zmq hands it back to the pool, possibly from its io thread, once the message is sent. The
+// sockets are closed before the pool goes away.
+void myzmq__send_jpeg( myjpeg *jpeg, myzmq *dest, char *head, int headLen ) {
+    if( !dest ) {
+        myjpeg__del( jpeg );
+        return;
+    }
+    // Without its header the jpeg would be read as the header of the next message
+    if( zmq_send( dest->socket, head, headLen, ZMQ_SNDMORE ) < 0 ) {
+        int err = zmq_errno();
+        fprintf(stderr, "ZMQ error sending jpeg header %i ( %s ); dropping the jpeg\n", err, decode_err( err ) );
+        myjpeg__del( jpeg );
+        return;
+    }
+    zmq_msg_t msg;
+    zmq_msg_init_data( &msg, jpeg->data, jpeg->size, myjpeg__zmq_free, jpeg );
+    if( zmq_msg_send( &msg, dest->socket, 0 ) < 0 ) zmq_msg_close( &msg );
+}
+
+// The header and the jpeg are gathered by nn_sendmsg, so the jpeg is not copied next to the
+// header first
+void mynano__send_jpeg( myjpeg *jpeg, int n, char *head, int headLen ) {
+    if(n) {
+        struct nn_iovec iov[2] = {
+            { head, headLen },
+            { jpeg->data, jpeg->size }
+        };
+        struct nn_msghdr hdr;
+        memset( &hdr, 0, sizeof( hdr ) );
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = 2;
+        nn_sendmsg( n, &hdr, 0 );
+    }
+    myjpeg__del( jpeg );
+}
+
+// Checkpoints from the start of run_stream till the first JPEG goes out
+typedef struct startup_timing_s {
+    struct timespec start;
+    struct timespec headers;
+    struct timespec decoder;
+    struct timespec firstFrame;
+    struct timespec firstJpeg;
+    char done;
+} startup_timing;
+
+static double ms_between( struct timespec *a, struct timespec *b ) {
+    return (double) timespecDiff( b, a ) / ( double ) 1000000;
+}
+
+void startup_timing__print( startup_timing *self ) {
+    printf("Startup timing (ms): headers %.2f, decoder open %.2f, first frame received %.2f, first jpeg %.2f\n",
+        ms_between( &self->start, &self->headers ),
+        ms_between( &self->headers, &self->decoder ),
+        ms_between( &self->decoder, &self->firstFrame ),
+        ms_between( &self->firstFrame, &self->firstJpeg ) );
+    printf("Time to first jpeg (ms): %.2f\n", ms_between( &self->start, &self->firstJpeg ) );
+}
+
+// Destination for finished JPEGs
+typedef struct jpeg_output_s {
+    int mode; // 0->file, 1->zmq, 2->nanomsg
+    int nanoOut;
+    myzmq *zmqOut;
+    int ow, oh, dw, dh;
+    int wroteJpeg; // bit per rendition
+    char regions; // put the rect of each jpeg in the header
+    rendition *rends; // with more than one the header names the rendition of each jpeg
+    int rendCount;
+    int fullCount;
+    int regionCount;
+    uint64_t bytes;
+    startup_timing *timing;
+    batch_output *batch; // takes every jpeg when set, whatever the mode
+    char name[16]; // first jpegs are kept as <name>.jpg; test when empty
+} jpeg_output;
+
+// JSON header sent ahead of each jpeg; with regions it also says where in the frame the jpeg
+// goes. Returns the length written to buf, which must hold 200 bytes.
+int jpeg_output__header( jpeg_output *self, myjpeg *jpeg, char *buf ) {
+    int dw = self->dw, dh = self->dh;
+    int len = 0;
+    if( self->rendCount > 1 ) {
+        rendition *r = &self->rends[ jpeg->rend ];
+        dw = r->dw;
+        dh = r->dh;
+        len = snprintf( buf, 200, "{\"r\":%i,", r->id );
+    }
+    else buf[ len++ ] = '{';
+    if( self->regions ) {
+        framerect *r = &jpeg->rect;
+        return len + snprintf( buf + len, 200 - len, "\"ow\":%i,\"oh\":%i,\"dw\":%i,\"dh\":%i,\"x\":%i,\"y\":%i,\"w\":%i,\"h\":%i}", self->ow, self->oh, dw, dh, r->x, r->y, r->w, r->h );
+    }
+    return len + snprintf( buf + len, 200 - len, "\"ow\":%i,\"oh\":%i,\"dw\":%i,\"dh\":%i}", self->ow, self->oh, dw, dh );
+}
+
+// Keep the first jpeg of each rendition as test.jpg, test_1.jpg and so on
+static void jpeg_output__write_first( jpeg_output *self, myjpeg *jpeg ) {
+    if( self->wroteJpeg & ( 1 << jpeg->rend ) ) {
+        myjpeg__del( jpeg );
+        return;
+    }
+    self->wroteJpeg |= 1 << jpeg->rend;
+    int id = self->rendCount > 1 ? self->rends[ jpeg->rend ].id : 0;
+    char *name = self->name[0] ? self->name : "test";
+    char filename[40];
+    if( id ) snprintf( filename, 40, "%s_%i.jpg", name, id );
+    else snprintf( filename, 40, "%s.jpg", name );
+    write_jpeg( jpeg, filename );
+}
+
+// Sends every jpeg in the chain. Frames are counted by their first rendition.
+void jpeg_output__send( jpeg_output *self, myjpeg *jpeg ) {
+    if( self->timing && !self->timing->done ) {
+        clock_gettime( CLOCK_MONOTONIC, &self->timing->firstJpeg );
+        self->timing->done = 1;
+        startup_timing__print( self->timing );
+    }
+    if( jpeg->rend == 0 ) {
+        if( jpeg->next && jpeg->next->rend == 0 ) self->regionCount++;
+        else if( jpeg->rect.w == self->dw && jpeg->rect.h == self->dh ) self->fullCount++;
+        else self->regionCount++;
+    }
     
-    if( ret < 0 ) {
-        av_strerror( ret, strErr, 200 );
-        fprintf(stderr, "Error while decoding: %s\n", strErr);
-        goto fail;
+    int mode = self->mode;
+    char head[200];
+    while( jpeg ) {
+        myjpeg *next = jpeg->next;
+        self->bytes += jpeg->size;
+        // Each branch takes the jpeg; batch output takes them all whatever the mode
+        if( self->batch ) batch_output__write( self->batch, jpeg );
+        else if( mode == 0 ) jpeg_output__write_first( self, jpeg );
+        else if( mode == 1 ) myzmq__send_jpeg( jpeg, self->zmqOut, head, jpeg_output__header( self, jpeg, head ) );
+        else if( mode == 2 ) {
+            if( !self->nanoOut ) jpeg_output__write_first( self, jpeg );
+            else mynano__send_jpeg( jpeg, self->nanoOut, head, jpeg_output__header( self, jpeg, head ) );
+        }
+        jpeg = next;
+    }
+}
+
+// Adaptive frame dropping
+//
+// Tracks how long frames take from the producer's timestamp till their jpeg is sent. While the
+// smoothed latency is over target, or chunks pile up waiting to be decoded, frames that no other
+// frame references are decoded but not converted or encoded. Once latency is back under 3/4 of
+// the target and the backlog has drained every frame is handled again.
+typedef struct latency_ctl_s {
+    uint64_t target; // ms; 0 disables the controller
+    int maxBacklog; // queued chunks that count as falling behind
+    double avg; // smoothed latency in ms
+    char dropping;
+    int dropped;
+    pthread_mutex_t lock; // samples come from whichever thread finishes the frame
+} latency_ctl;
+
+void latency_ctl__init( latency_ctl *self, uint64_t target ) {
+    memset( self, 0, sizeof( latency_ctl ) );
+    self->target = target;
+    self->maxBacklog = 8;
+    pthread_mutex_init( &self->lock, NULL );
+}
+
+void latency_ctl__sample( latency_ctl *self, uint64_t frameTime ) {
+    if( !self->target || !frameTime ) return;
+    uint64_t now = now_msec();
+    double latency = now > frameTime ? (double) ( now - frameTime ) : 0;
+    pthread_mutex_lock( &self->lock );
+    self->avg = self->avg ? self->avg * 0.8 + latency * 0.2 : latency;
+    pthread_mutex_unlock( &self->lock );
+}
+
+// Whether to skip converting and encoding a frame with the given nal_ref_idc
+char latency_ctl__drop( latency_ctl *self, int backlog, char refIdc ) {
+    if( !self->target ) return 0;
+    pthread_mutex_lock( &self->lock );
+    double avg = self->avg;
+    pthread_mutex_unlock( &self->lock );
+    
+    if( !self->dropping && ( avg > self->target || backlog > self->maxBacklog ) ) {
+        self->dropping = 1;
+        printf("Latency %.0f ms with %i queued; dropping non reference frames\n", avg, backlog );
+    }
+    else if( self->dropping && avg < self->target * 3 / 4 && backlog <= 1 ) {
+        self->dropping = 0;
+        printf("Latency %.0f ms; back to full rate\n", avg );
+    }
+    if( self->dropping && !refIdc ) {
+        self->dropped++;
+        return 1;
     }
+    return 0;
+}
 
-    av_hwframe_transfer_data( frame2, frame, 0 );
+void latency_ctl__free( latency_ctl *self ) {
+    pthread_mutex_destroy( &self->lock );
+}
+
+// Threaded pipeline
+//
+// decode ( calling thread ) -> prepare ( scale + diff ) -> N encoders -> send
+//
+// Every hop is a single producer / single consumer ring. The prepare stage deals frames out to
+// the encoders round robin and the send stage collects them in the same order, so output order
+// is preserved without any reordering buffer. With several renditions each one of a frame is its
+// own job, so the renditions of one frame are encoded in parallel.
+
+typedef struct frame_job_s {
+    AVFrame *frame;
+    uint64_t frameTime;
+    region_update update;
+    int rend; // index in frame_prep
+    myjpeg *jpeg;
+} frame_job;
+
+typedef struct encoder_s {
+    pthread_t thread;
+    tjhandle compressor;
+    ring *in;
+    ring *out;
+    frame_prep *prep;
+} encoder;
+
+typedef struct pipeline_s {
+    ring *decoded;
+    int encoderCount;
+    encoder *encoders;
+    pthread_t prepareThread;
+    pthread_t sendThread;
+    frame_prep *prep;
+    jpeg_output *out;
+    latency_ctl *latency;
+    objpool *jobs; // finished jobs for reuse
+} pipeline;
+
+#define PIPELINE_DEPTH 8
+
+static void pipeline__job_done( pipeline *self, frame_job *job ) {
+    if( !objpool__put( self->jobs, job ) ) free( job );
+}
+
+static frame_job *pipeline__job( pipeline *self ) {
+    frame_job *job = objpool__get( self->jobs );
+    if( !job ) job = calloc( sizeof( frame_job ), 1 );
+    job->jpeg = NULL;
+    job->rend = 0;
+    return job;
+}
+
+static void *pipeline__prepare_thread( void *arg ) {
+    pipeline *self = ( pipeline * ) arg;
+    frame_prep *prep = self->prep;
+    unsigned int seq = 0;
+    frame_job *jobs[ MAX_RENDITIONS ];
+    while( 1 ) {
+        frame_job *job = ( frame_job * ) ring__pop( self->decoded );
+        if( !job ) break;
+        AVFrame *frame3 = prepare_frame( prep, job->frame, job->frameTime, &job->update );
+        frame_pool__put( prep->frames, &job->frame );
+        if( !frame3 ) {
+            latency_ctl__sample( self->latency, job->frameTime );
+            pipeline__job_done( self, job );
+            continue;
+        }
+        job->frame = frame3;
+        jobs[0] = job;
+        // Scale every rendition before any goes out, as each is scaled from the one before
+        for( int i=1;i<prep->rendCount;i++ ) {
+            frame_job *rjob = jobs[i] = pipeline__job( self );
+            rjob->frame = rendition__scale( prep, i, jobs[ i - 1 ]->frame );
+            rjob->frameTime = job->frameTime;
+            rjob->update.count = 0;
+            rjob->rend = i;
+        }
+        for( int i=0;i<prep->rendCount;i++ ) {
+            ring__push( self->encoders[ seq % self->encoderCount ].in, jobs[i] );
+            seq++;
+        }
+    }
+    for( int i=0;i<self->encoderCount;i++ ) ring__close( self->encoders[i].in );
+    return NULL;
+}
+
+static void *pipeline__encode_thread( void *arg ) {
+    encoder *self = ( encoder * ) arg;
+    while( 1 ) {
+        frame_job *job = ( frame_job * ) ring__pop( self->in );
+        if( !job ) break;
+        job->jpeg = encode_update( self->compressor, job->frame, &job->update, &self->prep->rends[ job->rend ], job->rend );
+        frame_pool__put( self->prep->frames, &job->frame );
+        ring__push( self->out, job );
+    }
+    ring__close( self->out );
+    return NULL;
+}
+
+static void *pipeline__send_thread( void *arg ) {
+    pipeline *self = ( pipeline * ) arg;
+    for( unsigned int seq=0;;seq++ ) {
+        frame_job *job = ( frame_job * ) ring__pop( self->encoders[ seq % self->encoderCount ].out );
+        if( !job ) break;
+        if( job->jpeg ) jpeg_output__send( self->out, job->jpeg );
+        if( job->rend == self->prep->rendCount - 1 ) latency_ctl__sample( self->latency, job->frameTime );
+        pipeline__job_done( self, job );
+    }
+    return NULL;
+}
+
+// prep is only touched by the prepare thread until pipeline__finish returns
+pipeline *pipeline__new( int encoderCount, frame_prep *prep, jpeg_output *out, latency_ctl *latency ) {
+    pipeline *self = calloc( sizeof( pipeline ), 1 );
+    self->decoded = ring__new( PIPELINE_DEPTH );
+    self->encoderCount = encoderCount;
+    self->encoders = calloc( sizeof( encoder ), encoderCount );
+    self->prep = prep;
+    self->out = out;
+    self->latency = latency;
+    self->jobs = objpool__new( POOL_DEPTH );
     
-    /*CVPixelBufferRef pix_buf = (CVPixelBufferRef)frame2->data[3];
-    OSType pixel_format = CVPixelBufferGetPixelFormatType(pix_buf);
-    const char *pixStr = av_get_pix_fmt_name( pixel_format );
-    printf("Decoded Pixel format: %s\n", pixStr );*/
+    for( int i=0;i<encoderCount;i++ ) {
+        encoder *enc = &self->encoders[i];
+        enc->prep = prep;
+        enc->compressor = tjInitCompress();
+        enc->in = ring__new( PIPELINE_DEPTH );
+        enc->out = ring__new( PIPELINE_DEPTH );
+        pthread_create( &enc->thread, NULL, pipeline__encode_thread, enc );
+    }
+    pthread_create( &self->prepareThread, NULL, pipeline__prepare_thread, self );
+    pthread_create( &self->sendThread, NULL, pipeline__send_thread, self );
+    printf("Started pipeline with %i encoder threads\n", encoderCount );
+    return self;
+}
+
+// Hand a decoded frame to the pipeline; the pipeline takes ownership of it
+void pipeline__push( pipeline *self, AVFrame *frame, uint64_t frameTime ) {
+    frame_job *job = pipeline__job( self );
+    job->frame = frame;
+    job->frameTime = frameTime;
+    ring__push( self->decoded, job );
+}
+
+// Drain everything still in flight, stop the threads and free the pipeline
+void pipeline__finish( pipeline *self ) {
+    ring__close( self->decoded );
+    pthread_join( self->prepareThread, NULL );
+    for( int i=0;i<self->encoderCount;i++ ) pthread_join( self->encoders[i].thread, NULL );
+    pthread_join( self->sendThread, NULL );
+    
+    for( int i=0;i<self->encoderCount;i++ ) {
+        encoder *enc = &self->encoders[i];
+        tjDestroy( enc->compressor );
+        ring__del( enc->in );
+        ring__del( enc->out );
+    }
+    free( self->encoders );
+    ring__del( self->decoded );
+    frame_job *job;
+    while( ( job = objpool__get( self->jobs ) ) ) free( job );
+    objpool__del( self->jobs );
+    free( self );
+}
+
+// What next_packet knows about a packet beyond the AVPacket itself
+typedef struct packet_info_s {
+    uint64_t frameTime; // producer timestamp; kept from the last chunk that had one
+    char isHeader;
+    char refIdc; // nal_ref_idc of the first slice; 3 when the packet has no slice
+    char isKey;
+} packet_info;
+
+#define FRAME_NOTES 64 // more than the frames a frame threaded, reordering decoder holds back
+
+// What stream__packet knew about a frame, kept till the frame comes out of the decoder
+typedef struct frame_note_s {
+    uint64_t time;
+    char refIdc;
+    char kept; // already judged and kept by stream__packet
+} frame_note;
+
+// Per stream decode state used by run_stream
+typedef struct stream_s {
+    AVCodecContext *decoder_ctx;
+    tjhandle compressor;
+    frame_prep prep;
+    int frameCount;
+    int frameSkip;
+    pipeline *pipe;
+    jpeg_output out;
+    latency_ctl latency;
+    char dropNonRef; // skipped non reference slices are not given to the decoder at all
+    int undecoded;
+    enum AVDiscard skipLoopFilter; // applied while dropping, or always without a latency target
+    int firstFrame; // frames before firstFrame, from endFrame on, or off the every grid are not sent
+    int endFrame; // 0 for no end
+    int every;
+    int cachedFrames; // frames queued from the warm start cache still to be decoded
+    char waitKey; // live frames are dropped till a keyframe, as they cannot follow the cached one
+    frame_note notes[ FRAME_NOTES ]; // by frame number modulo FRAME_NOTES
+    int backlog; // chunks waiting as of the last packet
+    uint64_t frameTime; // time of the last packet
+} stream;
+
+// Whether frame n ( counted from 0 ) is selected for output
+char stream__wanted( stream *self, int64_t n ) {
+    if( n < self->firstFrame ) return 0;
+    if( self->endFrame && n >= self->endFrame ) return 0;
+    if( self->every > 1 && ( n - self->firstFrame ) % self->every ) return 0;
+    return 1;
+}
+
+// Whether frame n, with the given nal_ref_idc, is left out by selection, --frameSkip or the
+// latency controller
+static char stream__skip( stream *self, int64_t n, char refIdc ) {
+    if( !stream__wanted( self, n ) ) return 1;
+    if( self->frameSkip && ( ( n + 1 ) % self->frameSkip ) ) return 1;
+    return latency_ctl__drop( &self->latency, self->backlog, refIdc );
+}
+
+// Send a decoded frame on towards the output. Takes the frame.
+//
+// A frame threaded or reordering decoder hands frames out several packets after they went in,
+// so the skip decision and the time are taken from the note for the frame number in its pts
+// rather than from the packet just sent.
+static void stream__frame( stream *self, AVFrame *sysframe ) {
+    uint64_t frameTime = self->frameTime;
+    // Frames from packets decoded while probing carry no number and always go out
+    if( sysframe->pts != AV_NOPTS_VALUE ) {
+        frame_note *note = &self->notes[ sysframe->pts % FRAME_NOTES ];
+        frameTime = note->time;
+        if( !note->kept && stream__skip( self, sysframe->pts, note->refIdc ) ) {
+            frame_pool__put( self->prep.frames, &sysframe );
+            return;
+        }
+    }
+    if( self->pipe ) {
+        pipeline__push( self->pipe, sysframe, frameTime );
+        return;
+    }
+    myjpeg *jpeg = process_frame( self->compressor, &self->prep, sysframe, frameTime );
+    if( jpeg ) jpeg_output__send( &self->out, jpeg );
+    latency_ctl__sample( &self->latency, frameTime );
+}
+
+// Discard level by name as used for --skipLoopFilter
+enum AVDiscard discard_level( char *name ) {
+    if( !name || !strcmp( name, "none" ) ) return AVDISCARD_DEFAULT;
+    if( !strcmp( name, "nonref" ) ) return AVDISCARD_NONREF;
+    if( !strcmp( name, "bidir" ) ) return AVDISCARD_BIDIR;
+    if( !strcmp( name, "nonintra" ) ) return AVDISCARD_NONINTRA;
+    if( !strcmp( name, "nonkey" ) ) return AVDISCARD_NONKEY;
+    if( !strcmp( name, "all" ) ) return AVDISCARD_ALL;
+    fprintf(stderr, "Unknown discard level %s; using none\n", name );
+    return AVDISCARD_DEFAULT;
+}
+
+// Drain the frames the decoder is still holding back at the end of the input
+void stream__flush( stream *self ) {
+    AVPacket packet = { 0 };
+    if( avcodec_send_packet( self->decoder_ctx, &packet ) < 0 ) return;
+    AVFrame *sysframe;
+    while( ( sysframe = receive_frame( self->decoder_ctx, self->prep.frames ) ) ) {
+        stream__frame( self, sysframe );
+    }
+}
+
+// backlog is the number of chunks still waiting behind this packet
+void stream__packet( stream *self, AVPacket *packet, packet_info *info, int backlog ) {
+    char lastCached = 0;
+    if( self->pipe ) backlog += ring__count( self->pipe->decoded );
+    self->backlog = backlog;
+    self->frameTime = info->frameTime;
+    if( !info->isHeader ) {
+        if( self->cachedFrames ) lastCached = !--self->cachedFrames;
+        else if( self->waitKey ) {
+            if( !info->isKey ) return;
+            self->waitKey = 0;
+        }
+        // The frame number rides along in pts so frames can be matched up after reordering
+        packet->pts = self->frameCount;
+        frame_note *note = &self->notes[ self->frameCount % FRAME_NOTES ];
+        note->time = info->frameTime;
+        note->refIdc = info->refIdc;
+        note->kept = 0;
+        self->frameCount++;
+        
+        // Nothing references the slice, so the decoder never needs to see it. A frame left out
+        // never comes out of the decoder, so it is judged here rather than in stream__frame; one
+        // that is kept is not judged again there, so the controller counts every frame once.
+        if( self->dropNonRef && !info->refIdc ) {
+            if( stream__skip( self, packet->pts, 0 ) ) {
+                self->undecoded++;
+                return;
+            }
+            note->kept = 1;
+        }
+        // The controller state comes from the frames judged so far, the last one out of the
+        // decoder included. Frame threads copy skip_loop_filter when the packet is submitted, so
+        // the setting applies to this packet and not to one still in flight.
+        if( self->skipLoopFilter != AVDISCARD_DEFAULT ) {
+            char pressure = !self->latency.target || self->latency.dropping;
+            self->decoder_ctx->skip_loop_filter = pressure ? self->skipLoopFilter : AVDISCARD_DEFAULT;
+        }
+    }
+    AVFrame *sysframe = decode_frame( self->decoder_ctx, packet, self->prep.frames );
+    if( sysframe ) stream__frame( self, sysframe );
+    if( lastCached ) {
+        // Send the cached keyframe now rather than once live frames push it out of the decoder
+        stream__flush( self );
+        avcodec_flush_buffers( self->decoder_ctx );
+    }
+}
+
+static int read_packet( void *opaque, uint8_t *buf, int buf_size ) {
+    chunk_tracker *tracker = (chunk_tracker *) opaque;
+    int bufpos = 0;
+    
+    while( bufpos < buf_size ) {
+        chunk *curchunk = tracker__peek( tracker );
+        // If no chunk is ready; just return what we have so far
+        if( !curchunk ) break;
+        
+        int chunkleft = curchunk->size - tracker->pos;
+        int bufleft = buf_size - bufpos;
+        
+        // We can't fit the chunk into the buffer; write some of it
+        if( chunkleft > bufleft ) {
+            memcpy( &buf[bufpos], &curchunk->data[ tracker->pos ], bufleft );
+            tracker->pos += bufleft;
+            return buf_size;
+        }
+        
+        // The rest of the chunk fits; write it and move on to the next chunk
+        memcpy( &buf[bufpos], &curchunk->data[ tracker->pos ], chunkleft );
+        bufpos += chunkleft;
+        chunk__del( tracker__pop( tracker ) );
+    }
+    
+    if( !bufpos ) return AVERROR_EOF;
+    return bufpos;
+}
+
+
+AVFormatContext *new_memory_ctx( chunk_tracker *tracker ) {
+    int err;
+    
+    size_t avio_ctx_buffer_size = 50000;
+    uint8_t *avio_ctx_buffer = av_malloc( avio_ctx_buffer_size );
+    if (!avio_ctx_buffer) { err = AVERROR(ENOMEM); goto new_mctx_err; }
+    
+    AVIOContext *avio_ctx = avio_alloc_context( avio_ctx_buffer, avio_ctx_buffer_size, 0, tracker, &read_packet, NULL, NULL );
+    if (!avio_ctx) { err = AVERROR(ENOMEM); goto new_mctx_err; }
+    
+    AVFormatContext *fmt_ctx = avformat_alloc_context();
+    if( !fmt_ctx ) { err = AVERROR(ENOMEM); goto new_mctx_err; }
+    fmt_ctx->pb = avio_ctx;
+    
+    return fmt_ctx;
+    
+  new_mctx_err:
+    printf("new_mctx_err\n");
+    return NULL;
+}
+
+// Frees a list of chunks linked through next
+static void chunk__free_buffer( void *opaque, uint8_t *data ) {
+    chunk *c = (chunk *) opaque;
+    while( c ) {
+        chunk *next = c->next;
+        chunk__del( c );
+        c = next;
+    }
+}
+
+// Put a list of chunks linked through next, the slices of one picture, in one packet and free
+// them. Chunks that lie back to back in memory, as the slices of a mapped file do, are wrapped
+// without copying; they are freed with the packet's buffer, which frame threads may hold past
+// av_packet_unref. The decoder's bitstream reader runs up to AV_INPUT_BUFFER_PADDING_SIZE bytes
+// past the end of the data, so chunks without that much padding after the last, such as zmq
+// messages or a NAL at the very end of a mapped file, are copied instead.
+int chunk__to_packet( chunk *c, AVPacket *packet ) {
+    uint32_t size = c->size;
+    char contiguous = 1;
+    chunk *last = c;
+    for( chunk *n = c->next; n; n = n->next ) {
+        if( n->data != last->data + last->size ) contiguous = 0;
+        size += n->size;
+        last = n;
+    }
+    av_init_packet( packet );
+    packet->stream_index = 0;
+    if( contiguous && last->pad >= AV_INPUT_BUFFER_PADDING_SIZE ) {
+        packet->buf = av_buffer_create( (uint8_t *) c->data, size, chunk__free_buffer, c, AV_BUFFER_FLAG_READONLY );
+        if( packet->buf ) {
+            packet->data = packet->buf->data;
+            packet->size = size;
+            return 0;
+        }
+    }
+    int ret = av_new_packet( packet, size );
+    if( !ret ) {
+        uint32_t pos = 0;
+        for( chunk *n = c; n; n = n->next ) {
+            memcpy( packet->data + pos, n->data, n->size );
+            pos += n->size;
+        }
+    }
+    chunk__free_buffer( c, NULL );
+    return ret;
+}
+
+// nal_ref_idc of the first slice in an Annex B access unit; anything unknown counts as referenced
+static char packet__ref_idc( AVPacket *packet ) {
+    uint8_t *d = packet->data;
+    for( int i=0;i+3<packet->size;i++ ) {
+        if( d[i] || d[i+1] || d[i+2] != 1 ) continue;
+        int type = d[i+3] & 0x1F;
+        if( type == 1 || type == 5 ) return ( d[i+3] >> 5 ) & 3;
+    }
+    return 3;
+}
+
+// Fetch the next packet for the decoder. With avformat the chunks are demuxed through the
+// AVIOContext fed by read_packet. In direct mode each chunk is expected to be a whole NAL as
+// delivered by tracker.h; a header becomes a packet of its own and the slices of a picture
+// become one packet, as the decoder finishes a picture with the packet it came in. Like the
+// avformat parser, that means a picture is only handed over once the NAL after it is queued or
+// the tracker has ended.
+// Returns AVERROR(EAGAIN) in direct mode when no whole packet is queued.
+int next_packet( AVFormatContext *input_ctx, int video_stream, chunk_tracker *tracker, AVPacket *packet, packet_info *info ) {
+    info->isHeader = 0;
+    if( input_ctx ) {
+        while( 1 ) {
+            int ret = av_read_frame( input_ctx, packet );
+            if( ret < 0 ) return ret;
+            if( video_stream == packet->stream_index ) {
+                info->refIdc = packet__ref_idc( packet );
+                info->isKey = ( packet->flags & AV_PKT_FLAG_KEY ) ? 1 : 0;
+                return 0;
+            }
+            av_packet_unref( packet );
+        }
+    }
+    chunk *c = tracker__peek( tracker );
+    if( !c ) return AVERROR(EAGAIN);
+    int count = 1;
+    if( !chunk__isheader( c ) && !c->whole ) {
+        chunk *n = c->next;
+        for( ; n && slice__continues( n ); n = n->next ) count++;
+        if( !n && !tracker->ended ) return AVERROR(EAGAIN);
+    }
+    c = tracker__pop( tracker );
+    chunk *last = c;
+    for( int i=1;i<count;i++ ) last = last->next = tracker__pop( tracker );
+    
+    info->isHeader = chunk__isheader( c );
+    info->refIdc = ( c->easyType == 1 || c->easyType == 5 ) ? c->refIdc : 3;
+    // Joining mid picture, the first IDR slice seen may not start one
+    info->isKey = c->easyType == 5 && !slice__continues( c );
+    if( c->time ) info->frameTime = c->time;
+    return chunk__to_packet( c, packet );
+}
+
+// Give the decoder the SPS and PPS up front as Annex B extradata
+void set_extradata( AVCodecContext *ctx, chunk *sps, chunk *pps ) {
+    int size = sps->size + ( pps ? pps->size : 0 );
+    ctx->extradata = av_mallocz( size + AV_INPUT_BUFFER_PADDING_SIZE );
+    memcpy( ctx->extradata, sps->data, sps->size );
+    if( pps ) memcpy( ctx->extradata + sps->size, pps->data, pps->size );
+    ctx->extradata_size = size;
+}
+
+// Decoder for direct demux. With an sps the decoder is set up from it and from the headers in
+// the tracker, so nothing has to be probed.
+AVCodecContext *new_direct_decoder( AVCodec **decoder, chunk_tracker *tracker, sps_info *sps ) {
+    *decoder = avcodec_find_decoder( AV_CODEC_ID_H264 );
+    if( !*decoder ) {
+        fprintf(stderr, "Cannot find h264 decoder\n");
+        return NULL;
+    }
+    AVCodecContext *ctx = avcodec_alloc_context3( *decoder );
+    if( !ctx ) return NULL;
     
-    int w = frame2->width;
-    int h = frame2->height;
-    if( !dw ) {
-        dw = w;
-        dh = h;
+    if( sps ) {
+        ctx->width = sps->width;
+        ctx->height = sps->height;
+        ctx->profile = sps->profile;
+        ctx->level = sps->level;
+        set_extradata( ctx, tracker__find_type( tracker, 7 ), tracker__find_type( tracker, 8 ) );
     }
+    return ctx;
+}
 
-    struct SwsContext *sws_ctx = sws_getContext(
-        w, h, frame2->format,
-        dw, dh, AV_PIX_FMT_RGB24,
-        SWS_POINT, NULL, NULL, NULL );
+// Output size when none is given is the source size; anything over 1000 lines is halved
+void target_size( int srcw, int srch, int *dw, int *dh ) {
+    if( !*dw && !*dh ) {
+        *dw = srcw;
+        *dh = srch;
+    }
+    if( *dh > 1000 ) {
+        *dw /= 2;
+        *dh /= 2;
+    }
+}
 
-    AVFrame *frame3 = av_frame_alloc();
-    frame3->format = AV_PIX_FMT_RGB24;
-    frame3->width = dw;
-    frame3->height = dh;
-    av_frame_get_buffer( frame3, 32 );
-    
-    int resultHeight = sws_scale( sws_ctx,
-        (const uint8_t *const *) frame2->data, frame2->linesize, 0, h,
-        frame3->data, frame3->linesize );
+// A stream started from the warm start cache got a live SPS or PPS that differs from the cached
+// one its decoder was opened with. Send what the old decoder still holds, then open a new one
+// from the live headers, which the cache holds by now, and wait for a keyframe. A new source
+// size is followed unless keepSize; the pipeline is drained first so nothing uses the sizes while
+// they change.
+static int stream__reopen( stream *self, warmcache *cache, char *backend, char keepSize ) {
+    printf("Reopening the decoder from the live headers\n");
+    cache->stale = 0;
+    stream__flush( self );
     
-    if( resultHeight != dh ) {
-        fprintf(stderr, "Result height %i doesn't match destination height %i\n", resultHeight, dh );
+    chunk_tracker *headers = tracker__new();
+    tracker__add_copy( headers, &cache->nals[ WARM_SPS ] );
+    tracker__add_copy( headers, &cache->nals[ WARM_PPS ] );
+    chunk *spsChunk = tracker__find_type( headers, 7 );
+    sps_info sps;
+    AVCodec *decoder = NULL;
+    AVCodecContext *decoder_ctx = NULL;
+    if( spsChunk && sps__parse( (uint8_t *) spsChunk->data, spsChunk->size, &sps ) ) {
+        decoder_ctx = new_direct_decoder( &decoder, headers, &sps );
     }
+    tracker__del( headers );
+    if( !decoder_ctx || setup_decoder( decoder_ctx, decoder, backend ) < 0 || avcodec_open2( decoder_ctx, decoder, NULL ) < 0 ) {
+        fprintf(stderr, "Could not open a decoder from the live headers\n");
+        avcodec_free_context( &decoder_ctx );
+        return -1;
+    }
+    avcodec_free_context( &self->decoder_ctx );
+    self->decoder_ctx = decoder_ctx;
+    self->waitKey = 1;
     
-    sws_freeContext( sws_ctx );
-    
-    if( *prevframe ) {
-        char needFrame = 0;
-        if( *prevtime && ( frameTime - *prevtime ) > 1000 ) {
-            needFrame = 1;
-        }
-        if( !needFrame && !frameDif( frame3, *prevframe ) ) {
-            if( frame ) av_frame_free(&frame);
-            if( frame2 ) av_frame_free(&frame2);
-            av_frame_free( &frame3 );
-            //printf("Unchanged\n");
-            return NULL;
+    jpeg_output *out = &self->out;
+    if( sps.width != out->ow || sps.height != out->oh ) {
+        printf("Source dimensions are now %i x %i\n", sps.width, sps.height );
+        int encoders = self->pipe ? self->pipe->encoderCount : 0;
+        if( self->pipe ) pipeline__finish( self->pipe );
+        out->ow = sps.width;
+        out->oh = sps.height;
+        if( !keepSize ) {
+            int dw = 0, dh = 0;
+            target_size( sps.width, sps.height, &dw, &dh );
+            printf("Target dimensions are now %i x %i\n", dw, dh );
+            self->prep.dw = self->prep.rends[0].dw = out->dw = dw;
+            self->prep.dh = self->prep.rends[0].dh = out->dh = dh;
         }
-        av_frame_free( prevframe );
+        if( encoders ) self->pipe = pipeline__new( encoders, &self->prep, out, &self->latency );
     }
-    *prevframe = frame3;
-    *prevtime = now_msec();
-    
-    myjpeg *jpeg = raw_to_jpeg( compressor, (unsigned char *) frame3->data[0], dw, dh, "test.jpg", frame3->linesize[0] );
-    if( frame ) av_frame_free(&frame);
-    if( frame2 ) av_frame_free(&frame2);
-    //if( frame3 ) av_frame_free( &frame3 );
-    
-    uint64_t now = now_msec();
-    uint64_t dif = now - frameTime;
-    //printf("MS till jpeg: %lli\n", (long long) dif );
-    
-    return jpeg;
-    
-    fail:
-    if( frame ) av_frame_free(&frame);
-    if( frame2 ) av_frame_free(&frame2);
-    return NULL;
+    warmcache__set_size( cache, sps.width, sps.height, out->dw, out->dh );
+    return 0;
 }
 
-myjpeg *raw_to_jpeg( tjhandle compressor, unsigned char * buffer, int w, int h, const char* outfilename, int linesize ) {
-    const int JPEG_QUALITY = 75;
-    const int COLOR_COMPONENTS = 3;
-    myjpeg *jpeg = calloc( sizeof( myjpeg ), 1 );
+void read_difconf( ucmd *cmd, difconf *dif ) {
+    char *difStrideC = ucmd__get( cmd, "--difStride" );
+    char *difThresholdC = ucmd__get( cmd, "--difThreshold" );
+    char *tileThresholdC = ucmd__get( cmd, "--tileThreshold" );
+    if( difStrideC ) dif->stride = atoi( difStrideC );
+    if( difThresholdC ) dif->threshold = atoi( difThresholdC );
+    if( tileThresholdC ) dif->tileThreshold = atoi( tileThresholdC );
+}
 
-    int res = tjCompress2( compressor, buffer, w, linesize, h, TJPF_RGB, &jpeg->data, &jpeg->size, TJSAMP_420, JPEG_QUALITY, TJFLAG_FASTDCT );
-    if( res == -1 ) {
-        printf("tjCompress2 failed\n");
+// Multi stream server
+//
+// One process serves many devices. Every stream has its own receive thread, decoder, change
+// detection state and output socket. A receive thread queues chunks on its stream's ring and
+// puts the stream on the shared run queue; a pool of workers takes streams off the queue and
+// decodes, prepares and encodes whatever each one has waiting. A stream is on the queue at most
+// once and is handled by one worker at a time, so its state needs no locking.
+
+typedef struct server_s server;
+
+typedef struct server_stream_s {
+    int id;
+    server *srv;
+    int nanoIn;
+    ring *chunks; // receive thread -> worker
+    chunk_tracker *tracker; // chunks ready for the decoder
+    atomic_int queued; // 1 while on the run queue or held by a worker
+    atomic_int ended; // 1 once the receive thread is done, 2 once the decoder is flushed
+    uint64_t frameTime; // time of the last chunk decoded
+    pthread_t recvThread;
+    stream st;
+} server_stream;
+
+struct server_s {
+    server_stream *streams;
+    int streamCount;
+    pthread_t *workers;
+    int workerCount;
+    server_stream **runq; // circular; holds every stream at most once
+    int runqHead;
+    int runqCount;
+    int receiving; // receive threads still running
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *backend;
+    difconf dif;
+    char regions;
+    int dw, dh;
+    int frameSkip;
+    uint64_t maxLatency;
+    char dropNonRef;
+    enum AVDiscard skipLoopFilter;
+};
+
+#define SERVER_STREAM_DEPTH 64
+
+static void server__schedule( server *self, server_stream *s ) {
+    if( atomic_exchange( &s->queued, 1 ) ) return;
+    pthread_mutex_lock( &self->lock );
+    self->runq[ ( self->runqHead + self->runqCount ) % self->streamCount ] = s;
+    self->runqCount++;
+    pthread_cond_signal( &self->cond );
+    pthread_mutex_unlock( &self->lock );
+}
+
+// Open the decoder from the SPS received with the headers
+static int server_stream__open( server_stream *self ) {
+    server *srv = self->srv;
+    chunk *spsChunk = tracker__find_type( self->tracker, 7 );
+    sps_info sps;
+    if( !spsChunk || !sps__parse( (uint8_t *) spsChunk->data, spsChunk->size, &sps ) ) {
+        fprintf(stderr, "Stream %i: could not parse SPS\n", self->id );
+        return -1;
     }
-    return jpeg;
+    
+    AVCodec *decoder = NULL;
+    AVCodecContext *decoder_ctx = new_direct_decoder( &decoder, self->tracker, &sps );
+    if( !decoder_ctx ) return -1;
+    self->st.decoder_ctx = decoder_ctx;
+    latency_ctl__init( &self->st.latency, srv->maxLatency );
+    if( setup_decoder( decoder_ctx, decoder, srv->backend ) < 0 ) return -1;
+    // The worker pool spreads streams over the cores; decoder threads on top would only add latency
+    decoder_ctx->thread_count = 1;
+    if( avcodec_open2( decoder_ctx, decoder, NULL ) < 0 ) {
+        fprintf(stderr, "Stream %i: failed to open codec\n", self->id );
+        return -1;
+    }
+    
+    int dw = srv->dw, dh = srv->dh;
+    target_size( sps.width, sps.height, &dw, &dh );
+    printf("Stream %i: %i x %i -> %i x %i\n", self->id, sps.width, sps.height, dw, dh );
+    
+    stream *st = &self->st;
+    st->frameSkip = srv->frameSkip;
+    st->dropNonRef = srv->dropNonRef;
+    st->skipLoopFilter = srv->skipLoopFilter;
+    frame_prep__init( &st->prep, dw, dh, &srv->dif, srv->regions );
+    st->out.ow = sps.width; st->out.oh = sps.height;
+    st->out.dw = dw; st->out.dh = dh;
+    st->out.regions = srv->regions;
+    return 0;
 }
 
-void write_jpeg( myjpeg *jpeg, char *filename ) {
-    if( filename ) {
-        FILE *fh = fopen( filename, "wb" );
-        if( !fh ) {
-            fprintf(stderr,"Can't open %s for writing", filename );
+static void *server_stream__recv_thread( void *arg ) {
+    server_stream *self = ( server_stream * ) arg;
+    server *srv = self->srv;
+    
+    if( !tracker__mynano__recv_headers( self->tracker, self->nanoIn ) ) {
+        fprintf(stderr, "Stream %i: did not receive headers\n", self->id );
+    }
+    else if( !server_stream__open( self ) ) {
+        // The headers are left in the tracker for the first worker to feed to the decoder
+        while( 1 ) {
+            chunk *c = mynano__recv_chunk( self->nanoIn );
+            if( !c ) break;
+            ring__push( self->chunks, c );
+            server__schedule( srv, self );
         }
-        fwrite( jpeg->data, 1, jpeg->size, fh );
-        fclose( fh );
+        // A worker flushes the decoder once the ring is drained
+        atomic_store( &self->ended, 1 );
+        server__schedule( srv, self );
     }
-    tjFree( jpeg->data );
-    free( jpeg );
+    
+    pthread_mutex_lock( &srv->lock );
+    srv->receiving--;
+    pthread_cond_broadcast( &srv->cond );
+    pthread_mutex_unlock( &srv->lock );
+    return NULL;
 }
 
-void myzmq__send_jpeg( myjpeg *jpeg, myzmq *dest ) {
-    if( dest ) {
-        myzmq__send( dest, jpeg->data, jpeg->size );
+static void server_stream__decode_tracker( server_stream *self ) {
+    AVPacket packet;
+    packet_info info = { 0 };
+    info.frameTime = self->frameTime;
+    while( next_packet( NULL, 0, self->tracker, &packet, &info ) >= 0 ) {
+        stream__packet( &self->st, &packet, &info, tracker__depth( self->tracker ) + ring__count( self->chunks ) );
+        av_packet_unref( &packet );
     }
-    tjFree( jpeg->data );
-    free( jpeg );
+    self->frameTime = info.frameTime;
 }
 
-void mynano__send_jpeg( myjpeg *jpeg, int n, int ow, int oh, int dw, int dh ) {
-    if(n) {
-        char buffer[200];
-        int jlen = snprintf( buffer, 200, "{\"ow\":%i,\"oh\":%i,\"dw\":%i,\"dh\":%i}", ow, oh, dw, dh );
-        long unsigned int totlen = jpeg->size + jlen;
-        char *both = malloc( totlen );
-        memcpy( both, buffer, jlen );
-        memcpy( &both[jlen], jpeg->data, jpeg->size );
-        mynano__send( n, both, totlen );
-        free( both );
+// Decode and send what the stream has queued. At most a ring's worth of chunks is handled per
+// turn so one busy stream can't hold a worker while others wait; the rest waits for the next turn.
+static void server_stream__work( server_stream *self, tjhandle compressor ) {
+    self->st.compressor = compressor;
+    server_stream__decode_tracker( self );
+    for( int i=0;i<SERVER_STREAM_DEPTH && ring__count( self->chunks );i++ ) {
+        tracker__add_chunk( self->tracker, ( chunk * ) ring__pop( self->chunks ) );
+        server_stream__decode_tracker( self );
+    }
+    if( atomic_load( &self->ended ) == 1 && !ring__count( self->chunks ) ) {
+        self->tracker->ended = 1;
+        server_stream__decode_tracker( self );
+        stream__flush( &self->st );
+        atomic_store( &self->ended, 2 );
     }
-    tjFree( jpeg->data );
-    free( jpeg );
 }
 
-static int read_packet( void *opaque, uint8_t *buf, int buf_size ) {
-    chunk_tracker *tracker = (chunk_tracker *) opaque;
-    chunk *curchunk = tracker->curchunk;
-    if( !curchunk ) return AVERROR_EOF;
-    
-    int bufpos = 0;
-    int bufleft = buf_size;
-    int chunkleft = curchunk->size;
-    chunkleft -= tracker->pos;
-    
-    while( bufleft ) {
-        // We can't fit the chunk into the buffer; write some of it
-        if( chunkleft > bufleft ) {
-            chunkleft -= bufleft;
-            memcpy( &buf[bufpos], &curchunk->data[ tracker->pos ], bufleft );
-            tracker->pos += bufleft;
-            return buf_size;            
-        }
-        
-        // The chunk fits exactly. Write it into the buffer and return
-        if( chunkleft == bufleft ) {
-            memcpy( &buf[bufpos], &curchunk->data[ tracker->pos ], bufleft );
-            tracker->curchunk = curchunk->next;
-            chunk__del( curchunk );
-            tracker->pos = 0;
-            return buf_size;
+static void *server__worker_thread( void *arg ) {
+    server *self = ( server * ) arg;
+    tjhandle compressor = tjInitCompress();
+    while( 1 ) {
+        pthread_mutex_lock( &self->lock );
+        while( !self->runqCount && self->receiving ) pthread_cond_wait( &self->cond, &self->lock );
+        if( !self->runqCount ) {
+            pthread_mutex_unlock( &self->lock );
+            break;
         }
+        server_stream *s = self->runq[ self->runqHead ];
+        self->runqHead = ( self->runqHead + 1 ) % self->streamCount;
+        self->runqCount--;
+        pthread_mutex_unlock( &self->lock );
         
-        // The chunk is smaller than the buffer. Write it into the buffer and continue to next chunk
-        
-        // Write the chunk into the buffer
-        memcpy( &buf[bufpos], &curchunk->data[ tracker->pos ], chunkleft );
-        // Advance the buffer position
-        bufpos += chunkleft;
-        bufleft -= chunkleft;
+        server_stream__work( s, compressor );
         
-        // Continue to the next chunk then delete the chunk we wrote into the buffer
-        chunk *todel = curchunk;
-        curchunk = curchunk->next;
-        chunk__del( todel );
-        tracker->curchunk = curchunk;
-        tracker->pos = 0;
-       
-        // If no chunk is ready; just return what we have so far
-        if( !curchunk ) return bufpos; 
-         
-        chunkleft = curchunk->size;
+        // A chunk may have arrived after the ring was found empty but before queued was cleared
+        atomic_store( &s->queued, 0 );
+        if( ring__count( s->chunks ) || atomic_load( &s->ended ) == 1 ) server__schedule( self, s );
+    }
+    tjDestroy( compressor );
+    return NULL;
+}
+
+// Split a comma separated list in place; returns the number of items
+static int split_list( char *str, char **items, int max ) {
+    int count = 0;
+    char *save = NULL;
+    for( char *tok = strtok_r( str, ",", &save ); tok && count < max; tok = strtok_r( NULL, ",", &save ) ) {
+        items[ count++ ] = tok;
     }
-    return AVERROR_EOF; // unreachable...
+    return count;
 }
 
+#define MAX_STREAMS 256
 
-AVFormatContext *new_memory_ctx( chunk_tracker **ret ) {
-    int err;
+void run_server( ucmd *cmd ) {
+    ujsonin_init();
+    printf("Frame difference kernel: %s\n", framedif_init() );
     
-    chunk_tracker *tracker = calloc( sizeof( chunk_tracker ), 1 );
-    tracker->curchunk = NULL;
-    tracker->pos = 0;
+    server *self = calloc( sizeof( server ), 1 );
+    pthread_mutex_init( &self->lock, NULL );
+    pthread_cond_init( &self->cond, NULL );
     
-    size_t avio_ctx_buffer_size = 50000;
-    uint8_t *avio_ctx_buffer = av_malloc( avio_ctx_buffer_size );
-    if (!avio_ctx_buffer) { err = AVERROR(ENOMEM); goto new_mctx_err; }
+    self->backend = ucmd__get( cmd, "--decoder" );
+    if( !self->backend ) self->backend = DEFAULT_DECODER;
+    self->dif = ( difconf ) DIFCONF_DEFAULT;
+    read_difconf( cmd, &self->dif );
+    char *regionsC = ucmd__get( cmd, "--regions" );
+    if( regionsC ) self->regions = atoi( regionsC );
+    char *frameSkipC = ucmd__get( cmd, "--frameSkip" );
+    if( frameSkipC ) self->frameSkip = atoi( frameSkipC );
+    char *maxLatencyC = ucmd__get( cmd, "--maxLatency" );
+    if( maxLatencyC ) self->maxLatency = atoi( maxLatencyC );
+    char *dropNonRefC = ucmd__get( cmd, "--dropNonRef" );
+    if( dropNonRefC ) self->dropNonRef = atoi( dropNonRefC );
+    self->skipLoopFilter = discard_level( ucmd__get( cmd, "--skipLoopFilter" ) );
+    char *dwC = ucmd__get( cmd, "--dw" );
+    char *dhC = ucmd__get( cmd, "--dh" );
+    if( dwC && dhC ) {
+        self->dw = atoi( dwC );
+        self->dh = atoi( dhC );
+    }
     
-    AVIOContext *avio_ctx = avio_alloc_context( avio_ctx_buffer, avio_ctx_buffer_size, 0, tracker, &read_packet, NULL, NULL );
-    if (!avio_ctx) { err = AVERROR(ENOMEM); goto new_mctx_err; }
+    char *ins[ MAX_STREAMS ];
+    char *outs[ MAX_STREAMS ];
+    char *inList = strdup( ucmd__get( cmd, "--in" ) );
+    char *outC = ucmd__get( cmd, "--out" );
+    char *outList = outC ? strdup( outC ) : NULL;
+    int streamCount = split_list( inList, ins, MAX_STREAMS );
+    int outCount = outList ? split_list( outList, outs, MAX_STREAMS ) : 0;
+    if( outCount && outCount != streamCount ) {
+        fprintf(stderr, "Got %i outputs for %i inputs; there should be one per input\n", outCount, streamCount );
+        exit(1);
+    }
     
-    AVFormatContext *fmt_ctx = avformat_alloc_context();
-    if( !fmt_ctx ) { err = AVERROR(ENOMEM); goto new_mctx_err; }
-    fmt_ctx->pb = avio_ctx;
+    self->workerCount = sysconf( _SC_NPROCESSORS_ONLN );
+    char *workersC = ucmd__get( cmd, "--workers" );
+    if( workersC ) self->workerCount = atoi( workersC );
+    if( self->workerCount < 1 ) self->workerCount = 1;
     
-    *ret = tracker;
-    return fmt_ctx;
+    self->streamCount = streamCount;
+    self->streams = calloc( sizeof( server_stream ), streamCount );
+    self->runq = calloc( sizeof( server_stream * ), streamCount );
+    self->receiving = streamCount;
     
-  new_mctx_err:
-    printf("new_mctx_err\n");
-    return NULL;
+    for( int i=0;i<streamCount;i++ ) {
+        server_stream *s = &self->streams[i];
+        s->id = i;
+        s->srv = self;
+        s->chunks = ring__new( SERVER_STREAM_DEPTH );
+        s->tracker = tracker__new();
+        s->nanoIn = mynano__new( ins[i], 1 );
+        s->st.out.mode = 2;
+        if( outCount ) s->st.out.nanoOut = mynano__new( outs[i], 0 );
+        // Without an output each stream keeps its first jpeg in a file of its own
+        else snprintf( s->st.out.name, 16, "stream%i", i );
+        printf("Stream %i: %s -> %s\n", i, ins[i], outCount ? outs[i] : "none" );
+        pthread_create( &s->recvThread, NULL, server_stream__recv_thread, s );
+    }
+    
+    self->workers = calloc( sizeof( pthread_t ), self->workerCount );
+    for( int i=0;i<self->workerCount;i++ ) pthread_create( &self->workers[i], NULL, server__worker_thread, self );
+    printf("Serving %i streams with %i workers\n", streamCount, self->workerCount );
+    
+    for( int i=0;i<streamCount;i++ ) pthread_join( self->streams[i].recvThread, NULL );
+    for( int i=0;i<self->workerCount;i++ ) pthread_join( self->workers[i], NULL );
+    
+    for( int i=0;i<streamCount;i++ ) {
+        server_stream *s = &self->streams[i];
+        jpeg_output *out = &s->st.out;
+        printf("Stream %i: %i frames; sent %i full frames and %i region updates; dropped %i, %i never decoded\n", i, s->st.frameCount, out->fullCount, out->regionCount, s->st.latency.dropped, s->st.undecoded );
+        if( s->st.decoder_ctx ) {
+            avcodec_free_context( &s->st.decoder_ctx );
+            latency_ctl__free( &s->st.latency );
+        }
+        frame_prep__free( &s->st.prep );
+        tracker__del( s->tracker );
+        ring__del( s->chunks );
+    }
+    av_buffer_unref( &hw_device_ctx );
+    free( self->streams );
+    free( self->runq );
+    free( self->workers );
+    free( inList );
+    free( outList );
+    pthread_mutex_destroy( &self->lock );
+    pthread_cond_destroy( &self->cond );
+    free( self );
 }
 
 void setup_zmq_sockets( ucmd *cmd, myzmq **zmqIn, myzmq **zmqOut ) {
@@ -403,12 +1877,12 @@ void setup_zmq_sockets( ucmd *cmd, myzmq **zmqIn, myzmq **zmqOut ) {
     }
 }
 
-int run_stream( ucmd *cmd, int mode, int nanoIn, int nanoOut, myzmq *zmqIn, myzmq *zmqOut, FILE *fh );
+int run_stream( ucmd *cmd, int mode, int nanoIn, int nanoOut, myzmq *zmqIn, myzmq *zmqOut, mapreader *reader, batch_output *batch );
 
 void run_zmq( ucmd *cmd ) {
     myzmq *zmqIn = NULL, *zmqOut = NULL;
     setup_zmq_sockets( cmd, &zmqIn, &zmqOut );
-    run_stream( cmd, 1, 0, 0, zmqIn, zmqOut, NULL );
+    run_stream( cmd, 1, 0, 0, zmqIn, zmqOut, NULL, NULL );
 }
 
 void setup_nanomsg_sockets( ucmd *cmd, int *nanoIn, int *nanoOut ) {
@@ -426,17 +1900,132 @@ void setup_nanomsg_sockets( ucmd *cmd, int *nanoIn, int *nanoOut ) {
 void run_nano( ucmd *cmd ) {
     int nanoIn = 0, nanoOut = 0;
     setup_nanomsg_sockets( cmd, &nanoIn, &nanoOut );
-    run_stream( cmd, 2, nanoIn, nanoOut, NULL, NULL, NULL );
+    run_stream( cmd, 2, nanoIn, nanoOut, NULL, NULL, NULL, NULL );
 }
 
 void run_file( ucmd *cmd ) {
     char *file = ucmd__get(cmd, "--file");
-    FILE *fh = fopen( file, "rb" );
-    if( !fh ) {
+    mapreader *reader = mapreader__open( file );
+    if( !reader ) {
+        fprintf( stderr, "Cannot open input file '%s'\n", file );
+        return;
+    }
+    run_stream( cmd, 0, 0, 0, NULL, NULL, reader, NULL );
+    mapreader__close( reader );
+}
+
+// Decode frames first up to end ( 0 for the end of the file ) of a recorded file flat out and keep
+// the selected ones as jpegs. With an index decoding starts at the keyframe before first.
+static void run_batch_range( ucmd *cmd, mapreader *reader, keyindex *index, char *archive, int first, int end, int encoders ) {
+    batch_output *batch = batch_output__new( ucmd__get( cmd, "--outDir" ), archive );
+    if( !batch ) return;
+    batch->firstFrame = first;
+    batch->endFrame = end;
+    batch->encoders = encoders;
+    if( index && first ) batch->seek = keyindex__find_frame( index, first );
+    run_stream( cmd, 0, 0, 0, NULL, NULL, reader, batch );
+    printf("Wrote %i jpegs\n", batch->written );
+    batch_output__del( batch );
+}
+
+void run_batch( ucmd *cmd ) {
+    ujsonin_init();
+    char *file = ucmd__get(cmd, "--file");
+    mapreader *reader = mapreader__open( file );
+    if( !reader ) {
+        fprintf( stderr, "Cannot open input file '%s'\n", file );
+        return;
+    }
+    char *archive = ucmd__get( cmd, "--archive" );
+    char *outDir = ucmd__get( cmd, "--outDir" );
+    // Checked once here rather than by every segment
+    if( !archive && !batch_output__mkdir( outDir ? outDir : "." ) ) {
+        mapreader__close( reader );
+        return;
+    }
+    
+    // --to is inclusive
+    int first = 0, end = 0;
+    char *fromC = ucmd__get( cmd, "--from" );
+    char *toC = ucmd__get( cmd, "--to" );
+    char *fromTimeC = ucmd__get( cmd, "--fromTime" );
+    if( fromC ) first = atoi( fromC );
+    if( toC ) end = atoi( toC ) + 1;
+    
+    int segments = 1;
+    char *segmentsC = ucmd__get( cmd, "--segments" );
+    if( segmentsC ) segments = atoi( segmentsC );
+    int cores = sysconf( _SC_NPROCESSORS_ONLN );
+    
+    keyindex *index = NULL;
+    if( first || fromTimeC || segments > 1 ) index = keyindex__load( reader, file );
+    if( fromTimeC ) {
+        keyentry *key = keyindex__find_time( index, atoll( fromTimeC ) );
+        if( key ) first = key->frame;
+        else fprintf(stderr, "%s has no frame times; ignoring --fromTime\n", file );
+    }
+    
+    if( segments <= 1 || index->count < 2 ) {
+        run_batch_range( cmd, reader, index, archive, first, end, cores );
+    }
+    else {
+        // Each segment starts on a keyframe so it decodes on its own, in its own process. The
+        // jpegs are named by frame number so the segments can share an output dir; archives get
+        // one file per segment.
+        int64_t last = end ? end : index->frames;
+        int64_t segStart = first;
+        int encoders = cores / segments > 1 ? cores / segments : 1;
+        int seg = 0; // segments run so far; names the archives
+        int started = 0; // child processes to wait for
+        fflush( stdout );
+        for( int i=0;i<segments && segStart < last;i++ ) {
+            int64_t segEnd = last;
+            if( i < segments - 1 ) {
+                keyentry *key = keyindex__find_frame( index, first + ( last - first ) * ( i + 1 ) / segments );
+                if( !key || key->frame <= segStart ) continue;
+                segEnd = key->frame;
+            }
+            char segArchive[300];
+            if( archive ) snprintf( segArchive, 300, "%s.%i", archive, seg );
+            printf("Segment %i: frames %lld to %lld\n", seg, (long long) segStart, (long long) segEnd - 1 );
+            fflush( stdout );
+            pid_t pid = fork();
+            if( pid == 0 ) {
+                run_batch_range( cmd, reader, index, archive ? segArchive : NULL, segStart, segEnd, encoders );
+                exit( 0 );
+            }
+            if( pid < 0 ) {
+                fprintf(stderr, "Could not fork; running segment %i here\n", seg );
+                run_batch_range( cmd, reader, index, archive ? segArchive : NULL, segStart, segEnd, encoders );
+            }
+            else started++;
+            seg++;
+            segStart = segEnd;
+        }
+        while( started-- > 0 ) wait( NULL );
+    }
+    
+    if( index ) keyindex__del( index );
+    mapreader__close( reader );
+}
+
+// Write the keyframe sidecar for a recording so batch runs can seek and split it
+void run_index( ucmd *cmd ) {
+    ujsonin_init();
+    char *file = ucmd__get(cmd, "--file");
+    mapreader *reader = mapreader__open( file );
+    if( !reader ) {
         fprintf( stderr, "Cannot open input file '%s'\n", file );
         return;
     }
-    run_stream( cmd, 0, 0, 0, NULL, NULL, fh );
+    char keyFile[300];
+    snprintf( keyFile, 300, "%s.keys", file );
+    keyindex *index = keyindex__build( reader );
+    if( keyindex__write( index, keyFile ) ) {
+        printf("Indexed %i keyframes in %lld frames to %s\n", index->count, (long long) index->frames, keyFile );
+    }
+    keyindex__del( index );
+    mapreader__close( reader );
 }
 
 int main( int argc, char *argv[] ) {
@@ -447,32 +2036,115 @@ int main( int argc, char *argv[] ) {
         UOPT("--cachedir","Dir to store cache files in"),
         UOPT("--dw","Destination width"),
         UOPT("--dh","Destination height"),
+        UOPT("--decoder","Decoder backend; sw or a hw device type such as videotoolbox, vaapi, cuda"),
+        UOPT("--encoders","Number of JPEG encoder threads; enables the threaded pipeline"),
+        UOPT("--demux","avformat ( default ) or direct; direct hands the slices of each picture to the decoder as one packet"),
+        UOPT("--fastStart","1 to open the decoder straight from the SPS without probing; implies direct demux"),
+        UOPT("--difStride","Compare every Nth row when detecting changes; default 3"),
+        UOPT("--difThreshold","Frame difference total that counts as a change; default 2500"),
+        UOPT("--tileThreshold","Difference total that marks a 16x16 tile dirty; default 64"),
+        UOPT("--regions","1 to send only the changed regions of a frame, each as its own jpeg with x/y/w/h in the header"),
+        UOPT("--renditions","Comma separated WxH[:quality[:420|422|444|gray]] jpegs to make of every frame, tagged r in the header"),
+        UOPT("--dropNonRef","1 to keep skipped non reference frames away from the decoder entirely"),
+        UOPT("--skipLoopFilter","Deblocking to skip under load: none, nonref, bidir, nonkey or all"),
         NULL
     };
     uopt *nano_options[] = {
         UOPT_REQUIRED("--in","Nanomsg input spec"),
         UOPT("--out","Nanomsg output spec"),
         UOPT("--frameSkip","Frame skip mod; 2=half frames, 3=1/3 frames"),
+        UOPT("--maxLatency","Target ms from producer timestamp to sent jpeg; non reference frames are dropped while over it"),
         UOPT("--cacheid","ID to cache headers under"),
         UOPT("--cachedir","Dir to store cache files in"),
         UOPT("--dw","Destination width"),
         UOPT("--dh","Destination height"),
+        UOPT("--decoder","Decoder backend; sw or a hw device type such as videotoolbox, vaapi, cuda"),
+        UOPT("--encoders","Number of JPEG encoder threads; enables the threaded pipeline"),
+        UOPT("--demux","avformat ( default ) or direct; direct hands the slices of each picture to the decoder as one packet"),
+        UOPT("--fastStart","1 to open the decoder straight from the SPS without probing; implies direct demux"),
+        UOPT("--difStride","Compare every Nth row when detecting changes; default 3"),
+        UOPT("--difThreshold","Frame difference total that counts as a change; default 2500"),
+        UOPT("--tileThreshold","Difference total that marks a 16x16 tile dirty; default 64"),
+        UOPT("--regions","1 to send only the changed regions of a frame, each as its own jpeg with x/y/w/h in the header"),
+        UOPT("--renditions","Comma separated WxH[:quality[:420|422|444|gray]] jpegs to make of every frame, tagged r in the header"),
+        UOPT("--dropNonRef","1 to keep skipped non reference frames away from the decoder entirely"),
+        UOPT("--skipLoopFilter","Deblocking to skip under load: none, nonref, bidir, nonkey or all"),
         NULL
     };
     uopt *zmq_options[] = {
         UOPT_REQUIRED("--in","Zeromq input spec"),
         UOPT("--out","Zeromq output spec"),
         UOPT("--frameSkip","Frame skip mod; 2=half frames, 3=1/3 frames"),
+        UOPT("--maxLatency","Target ms from producer timestamp to sent jpeg; non reference frames are dropped while over it"),
+        UOPT("--cacheid","ID to cache headers under"),
+        UOPT("--cachedir","Dir to store cache files in"),
+        UOPT("--dw","Destination width"),
+        UOPT("--dh","Destination height"),
+        UOPT("--decoder","Decoder backend; sw or a hw device type such as videotoolbox, vaapi, cuda"),
+        UOPT("--encoders","Number of JPEG encoder threads; enables the threaded pipeline"),
+        UOPT("--demux","avformat ( default ) or direct; direct hands the slices of each picture to the decoder as one packet"),
+        UOPT("--fastStart","1 to open the decoder straight from the SPS without probing; implies direct demux"),
+        UOPT("--difStride","Compare every Nth row when detecting changes; default 3"),
+        UOPT("--difThreshold","Frame difference total that counts as a change; default 2500"),
+        UOPT("--tileThreshold","Difference total that marks a 16x16 tile dirty; default 64"),
+        UOPT("--regions","1 to send only the changed regions of a frame, each as its own jpeg with x/y/w/h in the header"),
+        UOPT("--renditions","Comma separated WxH[:quality[:420|422|444|gray]] jpegs to make of every frame, tagged r in the header"),
+        UOPT("--dropNonRef","1 to keep skipped non reference frames away from the decoder entirely"),
+        UOPT("--skipLoopFilter","Deblocking to skip under load: none, nonref, bidir, nonkey or all"),
+        NULL
+    };
+    uopt *server_options[] = {
+        UOPT_REQUIRED("--in","Comma separated nanomsg input specs; one per stream"),
+        UOPT("--out","Comma separated nanomsg output specs, in the same order as --in"),
+        UOPT("--workers","Number of decode/encode worker threads shared by all streams; default is one per core"),
+        UOPT("--frameSkip","Frame skip mod; 2=half frames, 3=1/3 frames"),
+        UOPT("--maxLatency","Target ms from producer timestamp to sent jpeg; non reference frames are dropped while over it"),
+        UOPT("--dw","Destination width"),
+        UOPT("--dh","Destination height"),
+        UOPT("--decoder","Decoder backend; sw or a hw device type such as videotoolbox, vaapi, cuda"),
+        UOPT("--difStride","Compare every Nth row when detecting changes; default 3"),
+        UOPT("--difThreshold","Frame difference total that counts as a change; default 2500"),
+        UOPT("--tileThreshold","Difference total that marks a 16x16 tile dirty; default 64"),
+        UOPT("--regions","1 to send only the changed regions of a frame, each as its own jpeg with x/y/w/h in the header"),
+        UOPT("--dropNonRef","1 to keep skipped non reference frames away from the decoder entirely"),
+        UOPT("--skipLoopFilter","Deblocking to skip under load: none, nonref, bidir, nonkey or all"),
+        NULL
+    };
+    uopt *batch_options[] = {
+        UOPT_REQUIRED("--file","File to process"),
+        UOPT("--outDir","Directory to write numbered jpegs to; default is the current dir"),
+        UOPT("--archive","Write all jpegs into this one file instead, with a frame/offset/size index in <archive>.index"),
+        UOPT("--from","First frame to keep, counting from 0"),
+        UOPT("--to","Last frame to keep"),
+        UOPT("--fromTime","Start at the last keyframe at most this many ms into the recording; needs frame times"),
+        UOPT("--segments","Split the frames at keyframes into this many pieces decoded by separate processes"),
+        UOPT("--every","Keep every Nth frame from --from on"),
+        UOPT("--changed","1 to keep only frames that differ from the last kept one"),
+        UOPT("--dw","Destination width"),
+        UOPT("--dh","Destination height"),
+        UOPT("--decoder","Decoder backend; sw or a hw device type such as videotoolbox, vaapi, cuda"),
+        UOPT("--encoders","Number of JPEG encoder threads; default is one per core, shared between segments"),
+        UOPT("--difStride","Compare every Nth row when detecting changes; default 3"),
+        UOPT("--difThreshold","Frame difference total that counts as a change; default 2500"),
+        UOPT("--tileThreshold","Difference total that marks a 16x16 tile dirty; default 64"),
+        UOPT("--dropNonRef","1 to skip decoding non reference frames that are not selected"),
+        NULL
+    };
+    uopt *index_options[] = {
+        UOPT_REQUIRED("--file","File to index"),
         NULL
     };
     uclop *opts = uclop__new( NULL, NULL );
     uclop__addcmd( opts, "file", "Process a file", &run_file, file_options );
     uclop__addcmd( opts, "nano", "Stream using nanomsg", &run_nano, nano_options );
     uclop__addcmd( opts, "zmq", "Stream using zmq", &run_zmq, zmq_options );
+    uclop__addcmd( opts, "batch", "Write frames of a file as jpegs as fast as possible", &run_batch, batch_options );
+    uclop__addcmd( opts, "index", "Write a keyframe index beside a recorded file", &run_index, index_options );
+    uclop__addcmd( opts, "server", "Serve many nanomsg streams from one process", &run_server, server_options );
     uclop__run( opts, argc, argv );
 }
 
-int run_stream( ucmd *cmd, int mode, int nanoIn, int nanoOut, myzmq *zmqIn, myzmq *zmqOut, FILE *fh ) {
+int run_stream( ucmd *cmd, int mode, int nanoIn, int nanoOut, myzmq *zmqIn, myzmq *zmqOut, mapreader *reader, batch_output *batch ) {
     ujsonin_init();
   
     int frameSkip = 0;
@@ -489,6 +2161,41 @@ int run_stream( ucmd *cmd, int mode, int nanoIn, int nanoOut, myzmq *zmqIn, myzm
         printf("Parsing file %i times\n", loops );
     }
     
+    int encoders = 0;
+    char *encodersC = ucmd__get( cmd, "--encoders" );
+    if( encodersC ) encoders = atoi( encodersC );
+    else if( batch ) encoders = batch->encoders;
+    
+    difconf dif = DIFCONF_DEFAULT;
+    read_difconf( cmd, &dif );
+    printf("Frame difference kernel: %s\n", framedif_init() );
+    
+    char regions = 0;
+    char *regionsC = ucmd__get( cmd, "--regions" );
+    if( regionsC ) regions = atoi( regionsC );
+    
+    rendition rends[ MAX_RENDITIONS ];
+    int rendCount = 0;
+    char *renditionsC = ucmd__get( cmd, "--renditions" );
+    if( renditionsC ) {
+        rendCount = renditions__parse( renditionsC, rends );
+        if( !rendCount ) return -1;
+        // One encoder per rendition, so the renditions of a frame are encoded side by side
+        if( !encodersC && rendCount > 1 ) encoders = rendCount;
+    }
+    
+    char *everyC = ucmd__get( cmd, "--every" );
+    char *changedC = ucmd__get( cmd, "--changed" );
+    char changedOnly = changedC ? atoi( changedC ) : 0;
+    
+    uint64_t maxLatency = 0;
+    char *maxLatencyC = ucmd__get( cmd, "--maxLatency" );
+    if( maxLatencyC ) maxLatency = atoi( maxLatencyC );
+    
+    char *dropNonRefC = ucmd__get( cmd, "--dropNonRef" );
+    char dropNonRef = dropNonRefC ? atoi( dropNonRefC ) : 0;
+    enum AVDiscard skipLoopFilter = discard_level( ucmd__get( cmd, "--skipLoopFilter" ) );
+    
     int dw = 0;
     int dh = 0;
     char *dwC = ucmd__get( cmd, "--dw" );
@@ -501,141 +2208,176 @@ int run_stream( ucmd *cmd, int mode, int nanoIn, int nanoOut, myzmq *zmqIn, myzm
     // mode 0->file, 1->zmq, 2->nanomsg
     struct timespec main_start, loop_start, diff;
     clock_gettime(CLOCK_MONOTONIC, &main_start);
+    startup_timing timing = { 0 };
+    timing.start = main_start;
     int ret;
     
-    enum AVHWDeviceType type = av_hwdevice_find_type_by_name( "videotoolbox" );
-    if( type == AV_HWDEVICE_TYPE_NONE ) {
-        fprintf( stderr, "Cannot find videotoolbox hw decoder.\n" );
-        return -1;
+    char *backend = ucmd__get( cmd, "--decoder" );
+    if( !backend ) backend = DEFAULT_DECODER;
+    
+    // direct demux wraps the chunks of each picture in a packet; avformat re-parses the byte stream
+    char direct = 0;
+    char *demux = ucmd__get( cmd, "--demux" );
+    if( demux && !strcmp( demux, "direct" ) ) direct = 1;
+    
+    // fast start opens the decoder from the SPS without any probing; it needs direct demux.
+    // Batch runs always use it so the first frame is not spent on probing.
+    char fastStart = 0;
+    char *fastStartC = ucmd__get( cmd, "--fastStart" );
+    if( ( fastStartC && atoi( fastStartC ) ) || batch ) {
+        fastStart = 1;
+        direct = 1;
     }
     
-    chunk_tracker *tracker;
-    AVFormatContext *input_ctx = new_memory_ctx( &tracker );
+    warmcache *cache = NULL;
+    char *cacheId = ucmd__get( cmd, "--cacheid" );
+    if( cacheId ) {
+        char *cacheDir = ucmd__get( cmd, "--cachedir" );
+        if( !cacheDir ) cacheDir = "cache";
+        char cacheFile[200];
+        snprintf( cacheFile, 200, "%s/%s", cacheDir, cacheId );
+        cache = warmcache__new( cacheFile );
+        if( warmcache__read( cache ) ) {
+            // The cached SPS is enough to open the decoder without probing
+            printf("Using cached stream state from %s\n", cacheFile );
+            fastStart = 1;
+            direct = 1;
+        }
+        else printf("Caching stream state at %s\n", cacheFile );
+    }
+    
+    chunk_tracker *tracker = tracker__new();
+    AVFormatContext *input_ctx = direct ? NULL : new_memory_ctx( tracker );
     
     char usedCache = 0;
+    int cachedFrames = 0;
     printf("Fetching headers to start decoder\n");
-    
-    char *cacheId = ucmd__get( cmd, "--cacheid" );
         
-    if( !cacheId ) {
-        if( mode == 0 ) tracker__read_headers( tracker, fh );
-        else if( mode == 1 ) tracker__myzmq__recv_headers( tracker, zmqIn );
-        else if( mode == 2 ) tracker__mynano__recv_headers( tracker, nanoIn );
+    if( batch && batch->seek ) {
+        printf("Starting at keyframe %lld\n", (long long) batch->seek->frame );
+        if( !tracker__map_seek( tracker, reader, batch->seek ) ) {
+            fprintf(stderr,"Could not read headers for keyframe; cannot continue\n");
+            return -1;
+        }
     }
-    else {
-        char *cacheDir = ucmd__get( cmd, "--cachedir" );
-        if( !cacheDir ) cacheDir = "cache";
-        char cacheFile[100];
-        snprintf( cacheFile, 100, "%s/%s", cacheDir, cacheId );
-        if( access( cacheFile, F_OK ) != -1 ) {
-            printf("Using cached headers from %s\n", cacheFile );
-            // cache exists; use it
-            FILE *fh = fopen( cacheFile, "rb" );
-            tracker__read_headers( tracker, fh );
-            fclose( fh );
-            usedCache = 1;
+    else if( cache && cache->loaded ) {
+        // The cached keyframe is decoded and sent while the live stream is on its way to its next one
+        cachedFrames = warmcache__queue( cache, tracker );
+        tracker__watch( tracker, warmcache__watch, cache );
+        usedCache = 1;
+        if( !dwC && !dhC ) {
+            dw = cache->dw;
+            dh = cache->dh;
         }
-        else {
-            // cache doesn't exist; read headers then store them
-            printf("Caching headers at %s\n", cacheFile );
-            char res = 0;
-            
-            if( mode == 0 ) res = tracker__read_headers( tracker, fh );
-            else if( mode == 1 ) res = tracker__myzmq__recv_headers( tracker, zmqIn );
-            else if( mode == 2 ) res = tracker__mynano__recv_headers( tracker, nanoIn );
-            
-            if( res == 0 ) {
-                fprintf(stderr,"Did not recieve headers; cannot continue\n");
-                exit(1);
-            }
-            FILE *fh = fopen( cacheFile, "wb+" );
-            tracker__write_file( tracker, fh );
-            fclose( fh );
+    }
+    else {
+        if( cache ) tracker__watch( tracker, warmcache__watch, cache );
+        char res = 0;
+        if( mode == 0 ) res = tracker__map_read_headers( tracker, reader );
+        else if( mode == 1 ) res = tracker__myzmq__recv_headers( tracker, zmqIn );
+        else if( mode == 2 ) res = tracker__mynano__recv_headers( tracker, nanoIn );
+        
+        if( cache && res == 0 ) {
+            fprintf(stderr,"Did not recieve headers; cannot continue\n");
+            exit(1);
         }
     }
     
-    AVInputFormat *format = av_find_input_format("h264");
-    if( !format ) {
-        fprintf( stderr, "Cannot find input format h264\n" );
-        return -1;
+    if( !direct ) {
+        AVInputFormat *format = av_find_input_format("h264");
+        if( !format ) {
+            fprintf( stderr, "Cannot find input format h264\n" );
+            return -1;
+        }
+        
+        printf("Opening Input\n");
+        ret = avformat_open_input( &input_ctx, NULL, format, NULL );
+        if( ret != 0 ) {
+            char strErr[200];
+            av_strerror( ret, strErr, 200 );
+            fprintf( stderr, "Cannot open input; %s\n", strErr );
+            return -1;
+        }
+        printf("Input Open\n");
     }
     
-    printf("Opening Input\n");
-    ret = avformat_open_input( &input_ctx, NULL, format, NULL );
-    if( ret != 0 ) {
-        char strErr[200];
-        av_strerror( ret, strErr, 200 );
-        fprintf( stderr, "Cannot open input; %s\n", strErr );
-        return -1;
+    clock_gettime( CLOCK_MONOTONIC, &timing.headers );
+    
+    int srcw = 0, srch = 0;
+    chunk *spsChunk = tracker__find_type( tracker, 7 );
+    sps_info sps;
+    if( fastStart ) {
+        if( spsChunk && sps__parse( (uint8_t *) spsChunk->data, spsChunk->size, &sps ) ) {
+            printf("SPS: profile %i, level %i, %i x %i\n", sps.profile, sps.level, sps.width, sps.height );
+            srcw = sps.width;
+            srch = sps.height;
+        }
+        else {
+            printf("Could not parse SPS; probing the stream instead of fast start\n");
+            fastStart = 0;
+        }
     }
-    printf("Input Open\n");
     
     int gotframe = 1;
     
-    printf("Fetching first frame to initialize decoder\n");
-    
-    if( mode == 0 ) {
-        gotframe = tracker__read_frame( tracker, fh ); // receives a non header frame
-    }
-    else if( mode == 1 ) {
-        // todo fix for cache
-        tracker__myzmq__recv_frame( tracker, zmqIn );
-    }
-    else if( mode == 2 ) {
-        if( usedCache ) tracker__mynano__recv_frame_non_header( tracker, nanoIn, NULL );
-        else tracker__mynano__recv_frame( tracker, nanoIn );
+    // Fast start opens the codec first and receives the first frame in the loop below
+    if( !fastStart ) {
+        printf("Fetching first frame to initialize decoder\n");
+        
+        if( mode == 0 ) {
+            gotframe = tracker__map_read_frame( tracker, reader ); // receives a non header frame
+        }
+        else if( mode == 1 ) {
+            if( usedCache ) tracker__myzmq__recv_frame_non_header( tracker, zmqIn, NULL );
+            else tracker__myzmq__recv_frame( tracker, zmqIn );
+        }
+        else if( mode == 2 ) {
+            if( usedCache ) tracker__mynano__recv_frame_non_header( tracker, nanoIn, NULL );
+            else tracker__mynano__recv_frame( tracker, nanoIn );
+        }
     }
     
-    // Find Stream Info doesn't "need" a first frame to function, but it complains if you don't give it one
-    printf("Finding stream info\n");
-    if (avformat_find_stream_info(input_ctx, NULL) < 0) {
-        fprintf(stderr, "Cannot find input stream information.\n");
-        return -1;
-    }
-     
-    printf("Finding best stream\n");
     AVCodec *decoder = NULL;
-    int video_stream = av_find_best_stream( input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
-    if( video_stream < 0 ) {
-        fprintf(stderr, "Cannot find a video stream in the input file\n");
-        return -1;
-    }
+    AVCodecContext *decoder_ctx = NULL;
+    int video_stream = 0;
     
-    printf("Getting hardware config\n");
-    int i;
-    for( i = 0;; i++ ) {
-        const AVCodecHWConfig *config = avcodec_get_hw_config( decoder, i );
-        if( !config ) {
-            fprintf(stderr, "Decoder %s does not support device type %s.\n", decoder->name, av_hwdevice_get_type_name(type));
+    if( direct ) {
+        printf("Demuxing chunks directly\n");
+        decoder_ctx = new_direct_decoder( &decoder, tracker, fastStart ? &sps : NULL );
+        if( !decoder_ctx ) return -1;
+    }
+    else {
+        // Find Stream Info doesn't "need" a first frame to function, but it complains if you don't give it one
+        printf("Finding stream info\n");
+        if (avformat_find_stream_info(input_ctx, NULL) < 0) {
+            fprintf(stderr, "Cannot find input stream information.\n");
             return -1;
         }
-        if( config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX && config->device_type == type ) {
-            hw_pix_fmt = config->pix_fmt;
-            //const char *pixStr = av_get_pix_fmt_name( hw_pix_fmt );
-            //printf("Pixel format name: %s\n", pixStr );
-            break;
+         
+        printf("Finding best stream\n");
+        video_stream = av_find_best_stream( input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+        if( video_stream < 0 ) {
+            fprintf(stderr, "Cannot find a video stream in the input file\n");
+            return -1;
         }
+        
+        decoder_ctx = avcodec_alloc_context3( decoder );
+        if( !decoder_ctx ) return AVERROR( ENOMEM );
+        
+        AVStream *video = input_ctx->streams[ video_stream ];
+        if( avcodec_parameters_to_context( decoder_ctx, video->codecpar ) < 0 ) return -1;
     }
     
-    AVCodecContext *decoder_ctx = avcodec_alloc_context3( decoder );
-    
-    if( !decoder_ctx ) return AVERROR( ENOMEM );
-    
-    AVStream *video = input_ctx->streams[ video_stream ];
-    if( avcodec_parameters_to_context( decoder_ctx, video->codecpar ) < 0 ) return -1;
-    
-    decoder_ctx->get_format  = get_hw_format;
-    // pixel format becomes AV_PIX_FMT_VIDEOTOOLBOX
-    
-    printf("Initiating decoder\n");
-    if( hw_decoder_init(decoder_ctx, type) < 0 ) return -1;
+    // with a hw backend the pixel format becomes the device format, ex: AV_PIX_FMT_VIDEOTOOLBOX
+    if( setup_decoder( decoder_ctx, decoder, backend ) < 0 ) return -1;
 
     if( avcodec_open2( decoder_ctx, decoder, NULL ) < 0 ) {
         fprintf(stderr, "Failed to open codec for stream #%u\n", video_stream);
         return -1;
     }
     
-    tjhandle compressor = tjInitCompress();
+    clock_gettime( CLOCK_MONOTONIC, &timing.decoder );
+    
     AVPacket packet;
     
     clock_gettime(CLOCK_MONOTONIC, &loop_start);
@@ -646,91 +2388,124 @@ int run_stream( ucmd *cmd, int mode, int nanoIn, int nanoOut, myzmq *zmqIn, myzm
             
     printf("Time from start of main till video loop: %f\n", (double) timeElapsed / ( double ) 1000000 );
     
-    int frameCount = 0;
-    uint64_t frameTime;
-    AVFrame *prevframe = NULL;
-    uint64_t prevtime = 0;
-    char wroteJpeg = 0;
+    packet_info info = { 0 };
     
-    int srcw, srch;
+    if( fastStart && !cachedFrames ) {
+        // The first frame is decoded and sent by the main loop like every other frame
+        if( mode == 0 ) gotframe = tracker__map_read_frame( tracker, reader );
+        else if( usedCache ) {
+            if( mode == 1 ) tracker__myzmq__recv_frame( tracker, zmqIn );
+            else if( mode == 2 ) tracker__mynano__recv_frame( tracker, nanoIn );
+        }
+        else if( mode == 1 ) tracker__myzmq__recv_frame_non_header( tracker, zmqIn, &info.frameTime );
+        else if( mode == 2 ) tracker__mynano__recv_frame_non_header( tracker, nanoIn, &info.frameTime );
+    }
     
-    for( int j=0;j<20;j++ ) {
-        if( mode == 0 ) gotframe = tracker__read_frame( tracker, fh );
-        else if( mode == 1 ) tracker__myzmq__recv_frame( tracker, zmqIn );
-        else if( mode == 2 ) tracker__mynano__recv_frame_non_header( tracker, nanoIn, &frameTime );
-            
-        if( ( ret = av_read_frame( input_ctx, &packet ) ) < 0 ) break;
-        if( video_stream != packet.stream_index ) { av_packet_unref(&packet); continue; }
-        get_frame_size( decoder_ctx, &packet, &srcw, &srch );
+    clock_gettime( CLOCK_MONOTONIC, &timing.firstFrame );
+    
+    for( int j=0;j<20 && !fastStart;j++ ) {
+        if( mode == 0 ) gotframe = tracker__map_read_frame( tracker, reader );
+        else if( mode == 1 ) tracker__myzmq__recv_frame_non_header( tracker, zmqIn, &info.frameTime );
+        else if( mode == 2 ) tracker__mynano__recv_frame_non_header( tracker, nanoIn, &info.frameTime );
+        
+        while( ( ret = next_packet( input_ctx, video_stream, tracker, &packet, &info ) ) >= 0 ) {
+            get_frame_size( decoder_ctx, &packet, &srcw, &srch );
+            av_packet_unref( &packet );
+            if( srcw || !direct ) break;
+        }
+        if( ret < 0 && ret != AVERROR(EAGAIN) ) break;
+        if( !srcw ) continue; // threaded decoders may not output a frame for the first few packets
         printf("Source dimensions %i x %i\n", srcw, srch );
         break;
     }
-    if( !dw && !dh ) {
-        dw = srcw;
-        dh = srch;
-    }
-    if( dh > 1000 ) {
-        dw /= 2;
-        dh /= 2;
+    if( rendCount ) {
+        dw = rends[0].dw;
+        dh = rends[0].dh;
     }
+    else if( !usedCache || dwC || dhC ) target_size( srcw, srch, &dw, &dh );
     printf("Target dimensions %i x %i\n", dw, dh );
+    if( cache ) warmcache__set_size( cache, srcw, srch, dw, dh );
+    
+    stream st = { 0 };
+    st.decoder_ctx = decoder_ctx;
+    st.compressor = tjInitCompress();
+    frame_prep__init( &st.prep, dw, dh, &dif, regions );
+    if( rendCount ) frame_prep__set_renditions( &st.prep, rends, rendCount );
+    st.frameSkip = frameSkip;
+    st.dropNonRef = dropNonRef;
+    st.skipLoopFilter = skipLoopFilter;
+    if( everyC ) st.every = atoi( everyC );
+    st.cachedFrames = cachedFrames;
+    st.waitKey = cachedFrames > 0;
+    if( batch ) {
+        st.firstFrame = batch->firstFrame;
+        st.endFrame = batch->endFrame;
+        if( batch->seek ) st.frameCount = batch->seek->frame;
+        // Without --changed every selected frame is kept; with it there is no forced full frame
+        st.prep.all = !changedOnly;
+        st.prep.keyInterval = 0;
+    }
+    
+    jpeg_output *out = &st.out;
+    out->mode = mode;
+    out->nanoOut = nanoOut;
+    out->zmqOut = zmqOut;
+    out->ow = srcw; out->oh = srch;
+    out->dw = dw; out->dh = dh;
+    out->regions = regions;
+    out->rends = st.prep.rends;
+    out->rendCount = st.prep.rendCount;
+    out->timing = &timing;
+    out->batch = batch;
     
-    while( ret >= 0 ) {
-        if( frameCount > 0 ) {
-            if( mode == 0 ) gotframe = tracker__read_frame( tracker, fh );
-            else if( mode == 1 ) tracker__myzmq__recv_frame( tracker, zmqIn );
-            else if( mode == 2 ) tracker__mynano__recv_frame_non_header( tracker, nanoIn, &frameTime );
+    latency_ctl__init( &st.latency, maxLatency );
+    if( encoders > 0 ) st.pipe = pipeline__new( encoders, &st.prep, out, &st.latency );
+    
+    char first = 1;
+    while( 1 ) {
+        if( !first ) {
+            // After a cached start the live headers are queued too, so the cache sees them and
+            // a change from the cached ones is caught
+            if( mode == 0 ) gotframe = tracker__map_read_frame( tracker, reader );
+            else if( usedCache ) {
+                if( mode == 1 ) tracker__myzmq__recv_frame( tracker, zmqIn );
+                else if( mode == 2 ) tracker__mynano__recv_frame( tracker, nanoIn );
+            }
+            else if( mode == 1 ) tracker__myzmq__recv_frame_non_header( tracker, zmqIn, &info.frameTime );
+            else if( mode == 2 ) tracker__mynano__recv_frame_non_header( tracker, nanoIn, &info.frameTime );
         }
+        first = 0;
         if( !gotframe ) {
-            if( mode != 0 ) break;
-            if( loops > loop ) {
+            if( mode == 0 && loops > loop ) {
                 loop++;
                 printf("Starting loop %i\n", loop );
-                fseek( fh, 0, SEEK_SET );
-                tracker__read_headers( tracker, fh );
+                mapreader__rewind( reader );
+                tracker__map_read_headers( tracker, reader );
                 continue;
             }
+            tracker->ended = 1; // the last picture goes to the decoder below
         }
-        if( ( ret = av_read_frame( input_ctx, &packet ) ) < 0 ) break;
-
-        if( video_stream == packet.stream_index ) {
-            frameCount++;
-            char skipThisFrame = 0;
-            if( frameSkip ) {
-                if( frameCount % frameSkip ) {
-                    //av_packet_unref( &packet );
-                    skipThisFrame = 1;
-                    //continue;
-                }
-            }
-            myjpeg *jpeg = process_frame( compressor, decoder_ctx, &packet, frameTime, skipThisFrame, &prevframe, &prevtime, dw, dh );
-            if( jpeg ) {
-                if( mode == 0 ) {
-                    if( !wroteJpeg ) {
-                        write_jpeg( jpeg, "test.jpg" );
-                        wroteJpeg = 1;
-                    }
-                    else {
-                        tjFree( jpeg->data );
-                        free( jpeg );
-                    }
-                }
-                if( mode == 1 ) myzmq__send_jpeg( jpeg, zmqOut );
-                else if( mode == 2 ) {
-                    if( !nanoOut && !wroteJpeg ) {
-                        write_jpeg( jpeg, "test.jpg" );
-                        wroteJpeg = 1;
-                    }
-                    else {
-                        mynano__send_jpeg( jpeg, nanoOut, srcw, srch, dw, dh );
-                    }
-                }
+        
+        while( ( ret = next_packet( input_ctx, video_stream, tracker, &packet, &info ) ) >= 0 ) {
+            // Every header queued ahead of this picture has been compared with the cache by now
+            if( cache && cache->stale && !info.isHeader && stream__reopen( &st, cache, backend, dwC || dhC || rendCount ) < 0 ) {
+                av_packet_unref( &packet );
+                ret = AVERROR_EXTERNAL;
+                break;
             }
+            stream__packet( &st, &packet, &info, tracker__depth( tracker ) );
+            av_packet_unref( &packet );
+            if( !direct ) break; // avformat reads one packet per received chunk
         }
-        
-        av_packet_unref(&packet);
+        if( ret < 0 && ret != AVERROR(EAGAIN) ) break;
+        if( !gotframe && direct ) break; // file is done and every queued chunk was decoded
+        if( st.endFrame && st.frameCount >= st.endFrame ) break; // past the selected range
     }
     
+    stream__flush( &st );
+    if( st.pipe ) pipeline__finish( st.pipe );
+    int frameCount = st.frameCount;
+    
     struct timespec loop_done;
     clock_gettime(CLOCK_MONOTONIC, &loop_done);
     
@@ -740,23 +2515,27 @@ int run_stream( ucmd *cmd, int mode, int nanoIn, int nanoOut, myzmq *zmqIn, myzm
 
     printf("Total framecount: %i\n", frameCount );
     printf("Time per frame (ms): %f\n", (double) timeElapsed2 / ( double ) 1000000 / (double) frameCount );
+    printf("Sent %i full frames and %i region updates; %llu jpeg bytes\n", out->fullCount, out->regionCount, (unsigned long long) out->bytes );
+    if( maxLatency ) printf("Dropped %i non reference frames to stay under %i ms\n", st.latency.dropped, (int) maxLatency );
+    if( dropNonRef ) printf("Skipped decoding %i non reference frames\n", st.undecoded );
     
-    // flush the decoder
-    packet.data = NULL;
-    packet.size = 0;
-    
-    myjpeg *jpeg = process_frame( compressor, decoder_ctx, &packet, 0, 1, NULL, 0, 0, 0 );
-    //if( mode == 1 ) myzmq__send_jpeg( jpeg, zmqOut );
-    //else if( mode == 2 ) mynano__send_jpeg( jpeg, nanoOut );
+    // zmq may still hold jpegs from the pool till its sockets are closed
+    if( zmqIn ) myzmq__del( zmqIn );
+    if( zmqOut ) myzmq__del( zmqOut );
+
+    if( cache ) {
+        warmcache__finish( cache );
+        warmcache__del( cache );
+    }
     
-    tjDestroy(compressor);
+    tjDestroy( st.compressor );
+    frame_prep__free( &st.prep );
+    latency_ctl__free( &st.latency );
     
-    avcodec_free_context(&decoder_ctx);
-    avformat_close_input(&input_ctx);
+    avcodec_free_context( &st.decoder_ctx ); // stream__reopen may have replaced decoder_ctx
+    if( input_ctx ) avformat_close_input(&input_ctx);
+    tracker__del( tracker );
     av_buffer_unref(&hw_device_ctx);
-
-    if( zmqIn ) myzmq__del( zmqIn );
-    if( zmqOut ) myzmq__del( zmqOut );
     
     return 0;
 }
@@ -0,0 +1,182 @@
+// Copyright (c) 2020 David Helkowski
+// Keyframe index for recorded streams
+//
+// One entry per IDR picture with the frame number it starts at, the producer time when the file
+// has one, and the file offsets of the IDR and of the SPS / PPS in force for it. With that a
+// reader can start decoding at any keyframe without reading the file up to it. The index is
+// kept in a text sidecar beside the recording:
+//   h264keys 2 <file size> <frame count>
+//   <frame> <time> <offset> <sps offset> <pps offset>
+// Frames are counted the way stream__packet counts them: every non header NAL is one frame,
+// except that the later slices of a picture belong to the frame of its first slice.
+
+#ifndef __KEYINDEX_H
+#define __KEYINDEX_H
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+
+#define KEYINDEX_VERSION 2
+
+typedef struct keyentry_s {
+    int64_t frame;
+    uint64_t time; // producer ms; 0 when the file carries no times
+    uint64_t offset;
+    uint64_t spsOffset;
+    uint64_t ppsOffset;
+} keyentry;
+
+typedef struct keyindex_s {
+    keyentry *entries;
+    int count;
+    int cap;
+    int64_t frames; // frames in the whole file
+    uint64_t fileSize;
+} keyindex;
+
+static void keyindex__add( keyindex *self, keyentry *entry ) {
+    if( self->count == self->cap ) {
+        self->cap = self->cap ? self->cap * 2 : 64;
+        self->entries = realloc( self->entries, sizeof( keyentry ) * self->cap );
+    }
+    self->entries[ self->count++ ] = *entry;
+}
+
+void keyindex__del( keyindex *self ) {
+    free( self->entries );
+    free( self );
+}
+
+// first_mb_in_slice of a slice NAL; 0 for the first slice of a picture
+static uint32_t slice__first_mb( chunk *c ) {
+    int sc = startcode_len( (uint8_t *) c->data, c->size );
+    bitreader br = { (uint8_t *) c->data + sc + 1, (int) c->size - sc - 1, 0, 0 };
+    return br__ue( &br );
+}
+
+// Whether c is a slice after the first of its picture
+static char slice__continues( chunk *c ) {
+    return ( c->easyType == 1 || c->easyType == 5 ) && slice__first_mb( c ) != 0;
+}
+
+// Scan the whole file once. The reader is left rewound.
+keyindex *keyindex__build( mapreader *reader ) {
+    keyindex *self = calloc( sizeof( keyindex ), 1 );
+    self->fileSize = reader->size;
+    uint64_t spsOffset = 0, ppsOffset = 0;
+    char gotSps = 0, gotPps = 0;
+    mapreader__rewind( reader );
+    while( 1 ) {
+        uint64_t offset = reader->pos;
+        chunk *c = mapreader__next( reader );
+        if( !c ) break;
+        if( c->easyType == 7 ) {
+            spsOffset = offset;
+            gotSps = 1;
+        }
+        else if( c->easyType == 8 ) {
+            ppsOffset = offset;
+            gotPps = 1;
+        }
+        if( c->easyType == 5 && gotSps && gotPps && slice__first_mb( c ) == 0 ) {
+            keyentry entry = { self->frames, c->time, offset, spsOffset, ppsOffset };
+            keyindex__add( self, &entry );
+        }
+        if( !chunk__isheader( c ) && !slice__continues( c ) ) self->frames++;
+        chunk__del( c );
+    }
+    mapreader__rewind( reader );
+    return self;
+}
+
+char keyindex__write( keyindex *self, char *path ) {
+    FILE *fh = fopen( path, "w" );
+    if( !fh ) {
+        fprintf(stderr, "Can't open %s for writing\n", path );
+        return 0;
+    }
+    fprintf( fh, "h264keys %i %llu %lld\n", KEYINDEX_VERSION, (unsigned long long) self->fileSize, (long long) self->frames );
+    for( int i=0;i<self->count;i++ ) {
+        keyentry *e = &self->entries[i];
+        fprintf( fh, "%lld %llu %llu %llu %llu\n", (long long) e->frame, (unsigned long long) e->time,
+            (unsigned long long) e->offset, (unsigned long long) e->spsOffset, (unsigned long long) e->ppsOffset );
+    }
+    fclose( fh );
+    return 1;
+}
+
+// NULL when the sidecar is missing, of another version or was made for a file of another size
+keyindex *keyindex__read( char *path, uint64_t fileSize ) {
+    FILE *fh = fopen( path, "r" );
+    if( !fh ) return NULL;
+    keyindex *self = calloc( sizeof( keyindex ), 1 );
+    int version = 0;
+    unsigned long long size = 0;
+    long long frames = 0;
+    if( fscanf( fh, "h264keys %i %llu %lld", &version, &size, &frames ) != 3 || version != KEYINDEX_VERSION || size != fileSize ) {
+        fclose( fh );
+        keyindex__del( self );
+        return NULL;
+    }
+    self->fileSize = size;
+    self->frames = frames;
+    long long frame;
+    unsigned long long time, offset, spsOffset, ppsOffset;
+    while( fscanf( fh, "%lld %llu %llu %llu %llu", &frame, &time, &offset, &spsOffset, &ppsOffset ) == 5 ) {
+        if( offset >= fileSize || spsOffset >= fileSize || ppsOffset >= fileSize ) break;
+        keyentry entry = { frame, time, offset, spsOffset, ppsOffset };
+        keyindex__add( self, &entry );
+    }
+    fclose( fh );
+    return self;
+}
+
+// Use the sidecar at <path>.keys when it is current; otherwise build it and store it there
+keyindex *keyindex__load( mapreader *reader, char *path ) {
+    char keyFile[300];
+    snprintf( keyFile, 300, "%s.keys", path );
+    keyindex *self = keyindex__read( keyFile, reader->size );
+    if( self ) return self;
+    printf("Indexing keyframes of %s\n", path );
+    self = keyindex__build( reader );
+    keyindex__write( self, keyFile );
+    return self;
+}
+
+// Last keyframe at or before frame; NULL when there is none
+keyentry *keyindex__find_frame( keyindex *self, int64_t frame ) {
+    int lo = 0, hi = self->count;
+    while( lo < hi ) {
+        int mid = ( lo + hi ) / 2;
+        if( self->entries[ mid ].frame <= frame ) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo ? &self->entries[ lo - 1 ] : NULL;
+}
+
+// Last keyframe at or before ms after the first keyframe; NULL when the file has no times
+keyentry *keyindex__find_time( keyindex *self, uint64_t ms ) {
+    if( !self->count || !self->entries[0].time ) return NULL;
+    uint64_t target = self->entries[0].time + ms;
+    keyentry *found = &self->entries[0];
+    for( int i=1;i<self->count && self->entries[i].time <= target;i++ ) found = &self->entries[i];
+    return found;
+}
+
+// Queue the SPS and PPS for entry and leave the reader at its IDR
+char tracker__map_seek( chunk_tracker *tracker, mapreader *reader, keyentry *entry ) {
+    reader->pos = entry->spsOffset;
+    chunk *sps = mapreader__next( reader );
+    reader->pos = entry->ppsOffset;
+    chunk *pps = mapreader__next( reader );
+    reader->pos = entry->offset;
+    if( !sps || !pps || sps->easyType != 7 || pps->easyType != 8 ) {
+        if( sps ) chunk__del( sps );
+        if( pps ) chunk__del( pps );
+        return 0;
+    }
+    tracker__add_chunk( tracker, sps );
+    tracker__add_chunk( tracker, pps );
+    return 1;
+}
+#endif
@@ -0,0 +1,175 @@
+// Copyright (c) 2020 David Helkowski
+// Memory mapped reader for recorded streams
+//
+// Reads both kinds of file read_chunk understands: raw Annex B as written by standard qvh, and
+// chunks framed with a 2 byte length and JSON header as written by chunk__write. The chunks it
+// returns point into the mapping, so the mapping has to stay open until they are all deleted.
+// Raw files may use 3 or 4 byte start codes.
+
+#ifndef __MAPREADER_H
+#define __MAPREADER_H
+#include<stdint.h>
+#include<string.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+
+typedef struct mapreader_s {
+    uint8_t *data;
+    size_t size;
+    size_t pos;
+    char framed; // chunks have a length and JSON header
+} mapreader;
+
+mapreader *mapreader__open( char *path ) {
+    int fd = open( path, O_RDONLY );
+    if( fd < 0 ) return NULL;
+    struct stat st;
+    if( fstat( fd, &st ) || !st.st_size ) {
+        close( fd );
+        return NULL;
+    }
+    void *data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd ); // the mapping keeps the file open
+    if( data == MAP_FAILED ) return NULL;
+    madvise( data, st.st_size, MADV_SEQUENTIAL );
+
+    mapreader *self = calloc( sizeof( mapreader ), 1 );
+    self->data = data;
+    self->size = st.st_size;
+    self->framed = self->size > 3 && self->data[2] == '{';
+    return self;
+}
+
+void mapreader__rewind( mapreader *self ) {
+    self->pos = 0;
+}
+
+void mapreader__close( mapreader *self ) {
+    munmap( self->data, self->size );
+    free( self );
+}
+
+// Length of the start code at d; 0 when there is none
+static int startcode_len( uint8_t *d, size_t left ) {
+    if( left >= 4 && !d[0] && !d[1] && !d[2] && d[3] == 1 ) return 4;
+    if( left >= 3 && !d[0] && !d[1] && d[2] == 1 ) return 3;
+    return 0;
+}
+
+// Offset of the next 00 00 01 at or after from, or size when there is none. memchr does the
+// scanning; emulation prevention guarantees the pattern never shows up inside a NAL.
+static size_t find_startcode( uint8_t *d, size_t from, size_t size ) {
+    size_t i = from + 2;
+    while( i < size ) {
+        uint8_t *one = memchr( d + i, 0x01, size - i );
+        if( !one ) break;
+        i = one - d;
+        if( !d[ i - 1 ] && !d[ i - 2 ] ) return i - 2;
+        i++;
+    }
+    return size;
+}
+
+// NULL when there is nothing after the start code. The mapping after the NAL, up to
+// CHUNK_PADDING bytes of it, is the chunk's padding.
+static chunk *mapreader__chunk( mapreader *self, uint8_t *data, size_t size ) {
+    int sc = startcode_len( data, size );
+    if( size <= (size_t) sc ) return NULL;
+    size_t after = self->data + self->size - ( data + size );
+    chunk *c = calloc( sizeof( chunk ), 1 );
+    c->data = (char *) data;
+    c->size = size;
+    c->type = data[ sc ];
+    c->dtype = 3;
+    c->pad = after < CHUNK_PADDING ? after : CHUNK_PADDING;
+    chunk__dump( c );
+    return c;
+}
+
+static chunk *mapreader__next_framed( mapreader *self ) {
+    while( self->pos + 2 <= self->size ) {
+        uint16_t jsonLen;
+        memcpy( &jsonLen, self->data + self->pos, 2 );
+        char *json = (char *) self->data + self->pos + 2;
+        if( self->pos + 2 + jsonLen > self->size ) return NULL;
+
+        uint32_t nalBytes;
+        uint64_t time;
+        chunk__json_header( json, jsonLen, &nalBytes, &time );
+
+        size_t start = self->pos + 2 + jsonLen;
+        if( !nalBytes || start + nalBytes > self->size ) return NULL;
+        self->pos = start + nalBytes;
+        chunk *c = mapreader__chunk( self, self->data + start, nalBytes );
+        if( !c ) continue; // a record holding only a start code
+        c->time = time;
+        return c;
+    }
+    return NULL;
+}
+
+static chunk *mapreader__next_raw( mapreader *self ) {
+    uint8_t *d = self->data;
+    size_t pos = self->pos;
+    int sc = startcode_len( d + pos, self->size - pos );
+    if( !sc ) {
+        if( pos < self->size ) fprintf(stderr, "not magic; not a good sign\n");
+        return NULL;
+    }
+    size_t end = find_startcode( d, pos + sc, self->size );
+    // the zero before a 4 byte start code belongs to the next NAL
+    if( end < self->size && !d[ end - 1 ] ) end--;
+    if( end <= pos + sc ) return NULL;
+    self->pos = end;
+    return mapreader__chunk( self, d + pos, end - pos );
+}
+
+// Next chunk, or NULL at the end of the file
+chunk *mapreader__next( mapreader *self ) {
+    return self->framed ? mapreader__next_framed( self ) : mapreader__next_raw( self );
+}
+
+chunk *mapreader__next_non_header( mapreader *self ) {
+    for( int i=0;i<10;i++ ) {
+        chunk *c = mapreader__next( self );
+        if( !c ) return NULL;
+        if( !chunk__isheader( c ) ) return c;
+        chunk__del( c );
+    }
+    return NULL;
+}
+
+char tracker__map_read_headers( chunk_tracker *tracker, mapreader *reader ) {
+    char gotSei = 0;
+    char gotSps = 0;
+    char gotPps = 0;
+    for( int i=0;i<10;i++ ) {
+        chunk *c = mapreader__next( reader );
+        if( !c ) return 0;
+
+        if( c->easyType == 6 ) gotSei = 1;
+        else if( c->easyType == 7 ) gotSps = 1;
+        else if( c->easyType == 8 ) gotPps = 1;
+        else {
+            printf("Got chunk type %i while trying to receive headers\n", c->easyType );
+            chunk__del( c );
+            return 0;
+        }
+        tracker__add_chunk( tracker, c );
+        if( gotSei && gotSps && gotPps ) return 1;
+    }
+    return 0;
+}
+
+int tracker__map_read_frame( chunk_tracker *tracker, mapreader *reader ) {
+    chunk *c = mapreader__next_non_header( reader );
+    if( c ) {
+        tracker__add_chunk( tracker, c );
+        return tracker->count;
+    }
+    printf("Could not fetch frame chunk\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,53 @@
+// Copyright (c) 2020 David Helkowski
+// Free list of reusable objects shared between threads
+//
+// The pool only keeps pointers; creating and destroying the objects is left to the caller, so it
+// works for AVFrames as well as plain structs. get returns NULL when the pool is empty and put
+// returns 0 when it is full; the caller then allocates or frees as it would without a pool.
+// Before objpool__del the caller empties the pool with get and frees what comes back.
+
+#ifndef __POOL_H
+#define __POOL_H
+#include<stdlib.h>
+#include<pthread.h>
+
+typedef struct objpool_s {
+    void **items;
+    int count;
+    int cap;
+    pthread_mutex_t lock;
+} objpool;
+
+objpool *objpool__new( int cap ) {
+    objpool *self = calloc( sizeof( objpool ), 1 );
+    self->items = calloc( sizeof( void * ), cap );
+    self->cap = cap;
+    pthread_mutex_init( &self->lock, NULL );
+    return self;
+}
+
+void *objpool__get( objpool *self ) {
+    void *item = NULL;
+    pthread_mutex_lock( &self->lock );
+    if( self->count ) item = self->items[ --self->count ];
+    pthread_mutex_unlock( &self->lock );
+    return item;
+}
+
+char objpool__put( objpool *self, void *item ) {
+    char kept = 0;
+    pthread_mutex_lock( &self->lock );
+    if( self->count < self->cap ) {
+        self->items[ self->count++ ] = item;
+        kept = 1;
+    }
+    pthread_mutex_unlock( &self->lock );
+    return kept;
+}
+
+void objpool__del( objpool *self ) {
+    pthread_mutex_destroy( &self->lock );
+    free( self->items );
+    free( self );
+}
+#endif
@@ -0,0 +1,102 @@
+// Copyright (c) 2020 David Helkowski
+// Bounded single producer / single consumer ring of pointers
+//
+// The fast path is lock free; the mutex and condition variable are only touched when
+// one side has to sleep because the ring is empty or full.
+
+#ifndef __RING_H
+#define __RING_H
+#include<stdlib.h>
+#include<pthread.h>
+#include<stdatomic.h>
+
+typedef struct ring_s {
+    void **slots;
+    unsigned int size; // always a power of two
+    unsigned int mask;
+    atomic_uint head; // next slot to write; only advanced by the producer
+    atomic_uint tail; // next slot to read; only advanced by the consumer
+    atomic_int waiting; // number of threads sleeping on cond
+    atomic_int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ring;
+
+ring *ring__new( unsigned int size ) {
+    unsigned int pow2 = 2;
+    while( pow2 < size ) pow2 *= 2;
+    ring *self = calloc( sizeof( ring ), 1 );
+    self->slots = calloc( sizeof( void * ), pow2 );
+    self->size = pow2;
+    self->mask = pow2 - 1;
+    pthread_mutex_init( &self->lock, NULL );
+    pthread_cond_init( &self->cond, NULL );
+    return self;
+}
+
+void ring__del( ring *self ) {
+    pthread_mutex_destroy( &self->lock );
+    pthread_cond_destroy( &self->cond );
+    free( self->slots );
+    free( self );
+}
+
+static void ring__wake( ring *self ) {
+    if( !atomic_load( &self->waiting ) ) return;
+    pthread_mutex_lock( &self->lock );
+    pthread_cond_broadcast( &self->cond );
+    pthread_mutex_unlock( &self->lock );
+}
+
+static char ring__full( ring *self ) {
+    return ( atomic_load( &self->head ) - atomic_load( &self->tail ) ) >= self->size;
+}
+
+static char ring__empty( ring *self ) {
+    return atomic_load( &self->head ) == atomic_load( &self->tail );
+}
+
+unsigned int ring__count( ring *self ) {
+    return atomic_load( &self->head ) - atomic_load( &self->tail );
+}
+
+// Blocks while the ring is full
+void ring__push( ring *self, void *item ) {
+    if( ring__full( self ) ) {
+        pthread_mutex_lock( &self->lock );
+        atomic_fetch_add( &self->waiting, 1 );
+        while( ring__full( self ) ) pthread_cond_wait( &self->cond, &self->lock );
+        atomic_fetch_sub( &self->waiting, 1 );
+        pthread_mutex_unlock( &self->lock );
+    }
+    unsigned int head = atomic_load( &self->head );
+    self->slots[ head & self->mask ] = item;
+    atomic_store( &self->head, head + 1 );
+    ring__wake( self );
+}
+
+// Blocks while the ring is empty. Returns NULL once the ring is closed and drained.
+void *ring__pop( ring *self ) {
+    if( ring__empty( self ) ) {
+        pthread_mutex_lock( &self->lock );
+        atomic_fetch_add( &self->waiting, 1 );
+        while( ring__empty( self ) && !atomic_load( &self->closed ) ) pthread_cond_wait( &self->cond, &self->lock );
+        atomic_fetch_sub( &self->waiting, 1 );
+        pthread_mutex_unlock( &self->lock );
+        if( ring__empty( self ) ) return NULL;
+    }
+    unsigned int tail = atomic_load( &self->tail );
+    void *item = self->slots[ tail & self->mask ];
+    atomic_store( &self->tail, tail + 1 );
+    ring__wake( self );
+    return item;
+}
+
+// Called by the producer once it will push nothing more
+void ring__close( ring *self ) {
+    pthread_mutex_lock( &self->lock );
+    atomic_store( &self->closed, 1 );
+    pthread_cond_broadcast( &self->cond );
+    pthread_mutex_unlock( &self->lock );
+}
+#endif
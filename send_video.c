@@ -10,7 +10,7 @@ int64_t timespecDiff(struct timespec *timeA_p, struct timespec *timeB_p) {
 
 int main( int argc, char *argv[] ) {
     if( argc < 4 ) {
-        fprintf(stderr, "Usage: %s <input file> <zmq/nano>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <input file> <zmq/nano> <spec> [raw/json/binary]\n", argv[0]);
         return -1;
     }
 
@@ -35,14 +35,21 @@ int main( int argc, char *argv[] ) {
     
     char *spec = argv[3];//"tcp://localhost:7878";
     
+    // raw sends bare NALs, json and binary add the header decode reads time from
+    int framing = 0;
+    if( argc > 4 ) {
+        if( !strcmp( argv[4], "json" ) ) framing = 1;
+        else if( !strcmp( argv[4], "binary" ) ) framing = 2;
+    }
+    
     if( mode == 1 ) {
         myzmq *z = myzmq__new( spec, 0 );
-        tracker__myzmq__send_chunks( tracker, z );
+        tracker__myzmq__send_chunks( tracker, z, framing );
         
         int frameCount = 1;
         while( 1 ) {
             int gotframe = tracker__read_frame( tracker, fh );
-            tracker__myzmq__send_chunks( tracker, z );
+            tracker__myzmq__send_chunks( tracker, z, framing );
             if( !gotframe ) break;
             frameCount++;
             printf( "Frame: %i\r", frameCount );
@@ -50,12 +57,12 @@ int main( int argc, char *argv[] ) {
     }
     if( mode == 2 ) {
         int nanoOut = mynano__new( spec, 0 );
-        tracker__mynano__send_chunks( tracker, nanoOut );
+        tracker__mynano__send_chunks( tracker, nanoOut, framing );
         
         int frameCount = 1;
         while( 1 ) {
             int gotframe = tracker__read_frame( tracker, fh );
-            tracker__mynano__send_chunks( tracker, nanoOut );
+            tracker__mynano__send_chunks( tracker, nanoOut, framing );
             if( !gotframe ) break;
             frameCount++;
             printf( "Frame: %i\r", frameCount );
@@ -0,0 +1,189 @@
+// Copyright (c) 2020 David Helkowski
+// Frame skipping with a frame threaded decoder
+//
+// A frame threaded decoder hands frames out several packets after they went in. This decodes a
+// raw Annex B recording with four frame threads and checks that the frames left out by
+// --frameSkip, the latency controller and --dropNonRef are the frames the decision was made
+// for, and that --skipLoopFilter follows the controller. The jpegs go to an archive whose index
+// lists the frame numbers that were sent.
+//
+// make skiptest && ./skip_test recording.h264
+
+#define main hw_decode_main
+#include"hw_decode.c"
+#undef main
+
+#define MAX_TEST_FRAMES 100000
+#define TEST_ARCHIVE "/tmp/skip_test.jpgs"
+
+static char refs[ MAX_TEST_FRAMES ]; // nal_ref_idc of each frame; 3 for a non slice NAL
+static char keys[ MAX_TEST_FRAMES ];
+static char sent[ MAX_TEST_FRAMES ];
+static int frames;
+
+// Number the frames the way stream__packet does: every non header NAL is one frame, except the
+// later slices of a picture
+static int scan( char *path ) {
+    mapreader *reader = mapreader__open( path );
+    if( !reader ) return 0;
+    chunk *c;
+    while( ( c = mapreader__next( reader ) ) && frames < MAX_TEST_FRAMES ) {
+        if( !chunk__isheader( c ) && !slice__continues( c ) ) {
+            refs[ frames ] = ( c->easyType == 1 || c->easyType == 5 ) ? c->refIdc : 3;
+            keys[ frames ] = c->easyType == 5;
+            frames++;
+        }
+        chunk__del( c );
+    }
+    mapreader__close( reader );
+    return frames;
+}
+
+typedef struct skip_case_s {
+    char *name;
+    int frameSkip;
+    uint64_t maxLatency;
+    int backlog; // reported to stream__packet for every packet; over 8 makes the controller drop
+    char dropNonRef;
+    enum AVDiscard skipLoopFilter;
+} skip_case;
+
+// Decode the whole recording for one case. Returns the stream's skip_loop_filter at the end and
+// fills sent.
+static int run_case( char *path, skip_case *sc, int *undecoded ) {
+    mapreader *reader = mapreader__open( path );
+    chunk_tracker *tracker = tracker__new();
+    if( !reader || !tracker__map_read_headers( tracker, reader ) ) {
+        fprintf(stderr, "%s has no headers at the start\n", path );
+        exit(1);
+    }
+    chunk *spsChunk = tracker__find_type( tracker, 7 );
+    sps_info sps;
+    if( !spsChunk || !sps__parse( (uint8_t *) spsChunk->data, spsChunk->size, &sps ) ) {
+        fprintf(stderr, "Could not parse SPS\n");
+        exit(1);
+    }
+    AVCodec *decoder = NULL;
+    AVCodecContext *decoder_ctx = new_direct_decoder( &decoder, tracker, &sps );
+    if( !decoder_ctx ) exit(1);
+    decoder_ctx->thread_count = 4;
+    decoder_ctx->thread_type = FF_THREAD_FRAME;
+    if( avcodec_open2( decoder_ctx, decoder, NULL ) < 0 ) {
+        fprintf(stderr, "Failed to open codec\n");
+        exit(1);
+    }
+
+    stream st = { 0 };
+    st.decoder_ctx = decoder_ctx;
+    st.compressor = tjInitCompress();
+    difconf dif = DIFCONF_DEFAULT;
+    int dw = 64, dh = ( 64 * sps.height / sps.width ) & ~1;
+    frame_prep__init( &st.prep, dw, dh, &dif, 0 );
+    st.prep.all = 1;
+    st.frameSkip = sc->frameSkip;
+    st.dropNonRef = sc->dropNonRef;
+    st.skipLoopFilter = sc->skipLoopFilter;
+    latency_ctl__init( &st.latency, sc->maxLatency );
+    batch_output *batch = batch_output__new( NULL, TEST_ARCHIVE );
+    st.out.ow = sps.width; st.out.oh = sps.height;
+    st.out.dw = dw; st.out.dh = dh;
+    st.out.batch = batch;
+
+    AVPacket packet;
+    packet_info info = { 0 };
+    while( tracker__map_read_frame( tracker, reader ) ) {
+        while( next_packet( NULL, 0, tracker, &packet, &info ) >= 0 ) {
+            stream__packet( &st, &packet, &info, sc->backlog );
+            av_packet_unref( &packet );
+        }
+    }
+    tracker->ended = 1;
+    while( next_packet( NULL, 0, tracker, &packet, &info ) >= 0 ) {
+        stream__packet( &st, &packet, &info, sc->backlog );
+        av_packet_unref( &packet );
+    }
+    stream__flush( &st );
+    int skipLoopFilter = decoder_ctx->skip_loop_filter;
+    *undecoded = st.undecoded;
+
+    batch_output__del( batch );
+    avcodec_free_context( &decoder_ctx );
+    latency_ctl__free( &st.latency );
+    frame_prep__free( &st.prep );
+    tjDestroy( st.compressor );
+    tracker__del( tracker );
+    mapreader__close( reader );
+
+    memset( sent, 0, sizeof( sent ) );
+    FILE *fh = fopen( TEST_ARCHIVE ".index", "r" );
+    long long frameNum;
+    unsigned long long offset;
+    unsigned long size;
+    while( fh && fscanf( fh, "%lld %llu %lu", &frameNum, &offset, &size ) == 3 ) {
+        if( frameNum >= 0 && frameNum < frames ) sent[ frameNum ] = 1;
+    }
+    if( fh ) fclose( fh );
+    return skipLoopFilter;
+}
+
+static int failures = 0;
+
+static void check( char *name, int ok, char *what ) {
+    if( ok ) return;
+    printf("FAIL %s: %s\n", name, what );
+    failures++;
+}
+
+int main( int argc, char *argv[] ) {
+    if( argc < 2 ) {
+        printf("Usage: %s recording.h264\n", argv[0] );
+        return 1;
+    }
+    if( !scan( argv[1] ) ) {
+        fprintf(stderr, "No frames in %s\n", argv[1] );
+        return 1;
+    }
+    int nonRef = 0;
+    for( int i=0;i<frames;i++ ) if( !refs[i] ) nonRef++;
+    printf("%i frames, %i not referenced\n", frames, nonRef );
+
+    skip_case every3 = { "frameSkip 3", 3, 0, 0, 0, AVDISCARD_DEFAULT };
+    skip_case idle = { "idle", 0, 1000, 0, 0, AVDISCARD_ALL };
+    skip_case busy = { "busy", 0, 1000, 100, 0, AVDISCARD_ALL };
+    skip_case busyDrop = { "busy with dropNonRef", 0, 1000, 100, 1, AVDISCARD_DEFAULT };
+    int undecoded;
+
+    // NALs that are not slices, such as access unit delimiters, are numbered but never come out
+    run_case( argv[1], &every3, &undecoded );
+    int wrong = 0;
+    for( int i=0;i<frames;i++ ) if( refs[i] != 3 && sent[i] != !( ( i + 1 ) % 3 ) ) wrong++;
+    check( every3.name, !wrong, "sent frames are not every third frame" );
+
+    int lf = run_case( argv[1], &idle, &undecoded );
+    wrong = 0;
+    for( int i=0;i<frames;i++ ) if( refs[i] != 3 && !sent[i] ) wrong++;
+    check( idle.name, !wrong, "frames were dropped without load" );
+    check( idle.name, lf == AVDISCARD_DEFAULT, "loop filter skipped without load" );
+
+    lf = run_case( argv[1], &busy, &undecoded );
+    wrong = 0;
+    int keysDropped = 0;
+    for( int i=0;i<frames;i++ ) {
+        if( refs[i] != 3 && sent[i] != ( refs[i] != 0 ) ) wrong++;
+        if( keys[i] && !sent[i] ) keysDropped++;
+    }
+    check( busy.name, !wrong, "dropped frames are not the non reference frames" );
+    check( busy.name, !keysDropped, "keyframes were dropped" );
+    check( busy.name, lf == AVDISCARD_ALL, "loop filter not skipped under load" );
+
+    run_case( argv[1], &busyDrop, &undecoded );
+    wrong = 0;
+    for( int i=0;i<frames;i++ ) if( refs[i] != 3 && sent[i] != ( refs[i] != 0 ) ) wrong++;
+    check( busyDrop.name, !wrong, "dropped frames are not the non reference frames" );
+    check( busyDrop.name, undecoded == nonRef, "not every non reference frame was kept from the decoder" );
+
+    unlink( TEST_ARCHIVE );
+    unlink( TEST_ARCHIVE ".index" );
+    printf( failures ? "%i failures\n" : "All passed\n", failures );
+    return failures ? 1 : 0;
+}
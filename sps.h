@@ -0,0 +1,169 @@
+// Copyright (c) 2020 David Helkowski
+// Minimal H.264 sequence parameter set parser
+//
+// Only pulls out what is needed to open a decoder without probing: profile, level and the
+// cropped picture dimensions.
+
+#ifndef __SPS_H
+#define __SPS_H
+#include<stdint.h>
+#include<string.h>
+
+typedef struct sps_info_s {
+    int profile;
+    int level;
+    int width;
+    int height;
+} sps_info;
+
+typedef struct bitreader_s {
+    uint8_t *data;
+    int len; // in bytes
+    int pos; // in bits
+    char overrun;
+} bitreader;
+
+static uint32_t br__bit( bitreader *self ) {
+    if( self->pos >= self->len * 8 ) {
+        self->overrun = 1;
+        return 0;
+    }
+    uint32_t bit = ( self->data[ self->pos >> 3 ] >> ( 7 - ( self->pos & 7 ) ) ) & 1;
+    self->pos++;
+    return bit;
+}
+
+static uint32_t br__bits( bitreader *self, int n ) {
+    uint32_t val = 0;
+    for( int i=0;i<n;i++ ) val = ( val << 1 ) | br__bit( self );
+    return val;
+}
+
+// unsigned exp-golomb
+static uint32_t br__ue( bitreader *self ) {
+    int zeros = 0;
+    while( !br__bit( self ) ) {
+        if( self->overrun || ++zeros > 31 ) {
+            self->overrun = 1;
+            return 0;
+        }
+    }
+    if( !zeros ) return 0;
+    return ( ( 1u << zeros ) - 1 ) + br__bits( self, zeros );
+}
+
+// signed exp-golomb
+static int32_t br__se( bitreader *self ) {
+    uint32_t v = br__ue( self );
+    if( v & 1 ) return (int32_t) ( ( v + 1 ) >> 1 );
+    return -(int32_t) ( v >> 1 );
+}
+
+static void sps__skip_scaling_list( bitreader *br, int size ) {
+    int last = 8, next = 8;
+    for( int i=0;i<size;i++ ) {
+        if( next ) {
+            int delta = br__se( br );
+            next = ( last + delta + 256 ) % 256;
+        }
+        if( next ) last = next;
+    }
+}
+
+// Parse an SPS NAL. data may start with a 3 or 4 byte start code. Returns 1 on success.
+char sps__parse( uint8_t *data, int len, sps_info *info ) {
+    // skip the start code
+    int start = 0;
+    while( start < len && data[ start ] == 0x00 ) start++;
+    if( start >= len || data[ start ] != 0x01 ) start = -1;
+    start++; // now at the NAL header ( or 0 when there was no start code )
+    if( start + 1 >= len ) return 0;
+    if( ( data[ start ] & 0x1F ) != 7 ) return 0;
+    start++;
+
+    // Strip emulation prevention bytes ( 00 00 03 -> 00 00 ). SPS NALs are small so a stack
+    // copy is fine; anything past the fields we need is not read.
+    uint8_t rbsp[ 256 ];
+    int rlen = 0;
+    int zeros = 0;
+    for( int i=start;i<len && rlen < (int) sizeof( rbsp );i++ ) {
+        uint8_t b = data[i];
+        if( zeros >= 2 && b == 0x03 ) {
+            zeros = 0;
+            continue;
+        }
+        zeros = b ? 0 : zeros + 1;
+        rbsp[ rlen++ ] = b;
+    }
+
+    bitreader br = { rbsp, rlen, 0, 0 };
+    int profile = br__bits( &br, 8 );
+    br__bits( &br, 8 ); // constraint flags
+    int level = br__bits( &br, 8 );
+    br__ue( &br ); // seq_parameter_set_id
+
+    int chroma_format_idc = 1;
+    int separate_colour_plane = 0;
+    if( profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 ||
+        profile == 83 || profile == 86 || profile == 118 || profile == 128 || profile == 138 ||
+        profile == 139 || profile == 134 || profile == 135 ) {
+        chroma_format_idc = br__ue( &br );
+        if( chroma_format_idc == 3 ) separate_colour_plane = br__bit( &br );
+        br__ue( &br ); // bit_depth_luma_minus8
+        br__ue( &br ); // bit_depth_chroma_minus8
+        br__bit( &br ); // qpprime_y_zero_transform_bypass_flag
+        if( br__bit( &br ) ) { // seq_scaling_matrix_present_flag
+            int lists = ( chroma_format_idc != 3 ) ? 8 : 12;
+            for( int i=0;i<lists;i++ ) {
+                if( br__bit( &br ) ) sps__skip_scaling_list( &br, i < 6 ? 16 : 64 );
+            }
+        }
+    }
+
+    br__ue( &br ); // log2_max_frame_num_minus4
+    int poc_type = br__ue( &br );
+    if( poc_type == 0 ) {
+        br__ue( &br ); // log2_max_pic_order_cnt_lsb_minus4
+    }
+    else if( poc_type == 1 ) {
+        br__bit( &br ); // delta_pic_order_always_zero_flag
+        br__se( &br ); // offset_for_non_ref_pic
+        br__se( &br ); // offset_for_top_to_bottom_field
+        int cycle = br__ue( &br );
+        if( cycle > 255 ) return 0;
+        for( int i=0;i<cycle;i++ ) br__se( &br );
+    }
+    br__ue( &br ); // max_num_ref_frames
+    br__bit( &br ); // gaps_in_frame_num_value_allowed_flag
+    int width_mbs = br__ue( &br ) + 1;
+    int height_map_units = br__ue( &br ) + 1;
+    int frame_mbs_only = br__bit( &br );
+    if( !frame_mbs_only ) br__bit( &br ); // mb_adaptive_frame_field_flag
+    br__bit( &br ); // direct_8x8_inference_flag
+
+    int width = width_mbs * 16;
+    int height = height_map_units * 16 * ( 2 - frame_mbs_only );
+
+    if( br__bit( &br ) ) { // frame_cropping_flag
+        int left = br__ue( &br );
+        int right = br__ue( &br );
+        int top = br__ue( &br );
+        int bottom = br__ue( &br );
+        int cropx = 1, cropy = 2 - frame_mbs_only;
+        if( !separate_colour_plane && chroma_format_idc ) {
+            if( chroma_format_idc != 3 ) cropx = 2;
+            if( chroma_format_idc == 1 ) cropy *= 2;
+        }
+        width -= ( left + right ) * cropx;
+        height -= ( top + bottom ) * cropy;
+    }
+
+    if( br.overrun || width <= 0 || height <= 0 ) return 0;
+
+    info->profile = profile;
+    info->level = level;
+    info->width = width;
+    info->height = height;
+    return 1;
+}
+#endif
@@ -68,23 +68,59 @@ char *decode_err( int e ) {
     return "?";
 }
 
-char buffer[ 500000 ];
-
-chunk *myzmq__recv_chunk( myzmq *z ) {
-    int size = zmq_recv( z->socket, buffer, 500000, 0 );
-    if( !size ) return NULL;
+static zmq_msg_t *myzmq__recv_msg( myzmq *z ) {
+    zmq_msg_t *msg = malloc( sizeof( zmq_msg_t ) );
+    zmq_msg_init( msg );
+    int size = zmq_msg_recv( msg, z->socket, 0 );
+    if( size > 0 ) return msg;
     if( size == -1 ) {
         int err = zmq_errno();
         printf("ZMQ error receiving %i ( %s )\n", err, decode_err( err ) );
+    }
+    zmq_msg_close( msg );
+    free( msg );
+    return NULL;
+}
+
+static void myzmq__free_msg( zmq_msg_t *msg ) {
+    zmq_msg_close( msg );
+    free( msg );
+}
+
+int chunk__unframe( char *buf, int size, uint32_t *nalBytes, uint64_t *time );
+
+// Receives a bare NAL, a NAL with its header in front as nanomsg sends it, or a header part
+// followed by a NAL part as myzmq__send_chunk_framed sends it. The chunk takes over the zmq
+// message of the NAL, so it is not copied and may be of any size. rawptr holds the zmq_msg_t;
+// chunk__del closes it.
+chunk *myzmq__recv_chunk( myzmq *z ) {
+    zmq_msg_t *msg = myzmq__recv_msg( z );
+    if( !msg ) return NULL;
+    uint32_t nalBytes;
+    uint64_t time;
+    int dataStart = chunk__unframe( zmq_msg_data( msg ), zmq_msg_size( msg ), &nalBytes, &time );
+    if( dataStart > 0 && dataStart == (int) zmq_msg_size( msg ) && zmq_msg_more( msg ) ) {
+        myzmq__free_msg( msg );
+        msg = myzmq__recv_msg( z );
+        if( !msg ) return NULL;
+        dataStart = 0;
+    }
+    int size = (int) zmq_msg_size( msg ) - dataStart;
+    if( dataStart < 0 || size <= 0 ) {
+        myzmq__free_msg( msg );
         return NULL;
     }
+    if( nalBytes && nalBytes != size ) {
+        printf("Header size doesn't match data payload; %li != %li\n", (long) nalBytes, (long) size );
+    }
     //printf("Received zmq chunk of size %i\n", size );
     chunk *c = calloc( sizeof( chunk ), 1 );
+    c->time = time;
     c->size = size;
-    c->data = malloc( size );
-    c->type = buffer[4];
+    c->rawptr = (char *) msg;
+    c->data = (char *) zmq_msg_data( msg ) + dataStart;
+    c->type = size > 4 ? c->data[4] : 0;
     c->dtype = 2;
-    memcpy( c->data, buffer, size );
     chunk__dump( c );
     return c;
 }
@@ -93,92 +129,227 @@ void chunk__del( chunk *c ) {
     if( !c ) return;
     if( c->dtype == 0 ) free( c->data );
     if( c->dtype == 1 ) nn_freemsg( c->rawptr );
-    if( c->dtype == 2 ) free( c->data );
+    if( c->dtype == 2 ) myzmq__free_msg( (zmq_msg_t *) c->rawptr );
+    // dtype 3 points into a file mapped by mapreader.h; nothing to free
     free( c );
 }
 
-uint32_t antol( char *str, int len ) {
-    char *dup = strndup( str, len );
-    uint32_t res = atol( dup );
-    free( dup );
+// Digits of a JSON number; parsed in place since the string is not terminated
+uint64_t antoll( char *str, int len ) {
+    uint64_t res = 0;
+    for( int i=0;i<len && str[i] >= '0' && str[i] <= '9';i++ ) res = res * 10 + ( str[i] - '0' );
     return res;
 }
 
+uint32_t antol( char *str, int len ) {
+    return (uint32_t) antoll( str, len );
+}
+
 uint32_t nodetol( node_str *node ) {
     if( !node ) return 0;
     return antol( node->str, node->len );
 }
 
-uint64_t antoll( char *str, int len ) {
-    char *dup = strndup( str, len );
-    uint64_t res = atoll( dup );
-    free( dup );
-    return res;
-}
-
 uint64_t nodetoll( node_str *node ) {
     if( !node ) return 0;
     return antoll( node->str, node->len );
 }
 
-chunk *mynano__recv_chunk( int n ) {
-    char *buf = NULL;
-    int size = nn_recv( n, &buf, NN_MSG, 0 );
-    if( !size ) return NULL;
-    if( size < 0 ) { fprintf(stderr, "nn_recv err %i\n", size ); return NULL; }
-    
-    //printf("Received nanomsg chunk of size %i\n", size );
-    
-    chunk *c = calloc( sizeof( chunk ), 1 );
-    //c->size = size;
-    
-    uint16_t jsonLen = * ( (uint16_t *) buf );
-    //printf("Size: %i, JSON: %.*s\n", size, jsonLen, &buf[3] );
-    
-    uint16_t dataStart = jsonLen + 2;
+// nalBytes and time from the JSON header of a chunk, read without building a parse tree.
+// Returns 0 when the header has no time.
+char chunk__json_header( char *json, int len, uint32_t *nalBytes, uint64_t *time ) {
+    jint fields[2] = { { "nalBytes", 8 }, { "time", 4 } };
+    parse_ints( json, len, fields, 2 );
+    *nalBytes = fields[0].found ? (uint32_t) fields[0].val : 0;
+    *time = fields[1].found ? (uint64_t) fields[1].val : 0;
+    return fields[1].found;
+}
+
+// Header fields collected by chunk_json__field while a JSON header streams through jstream
+typedef struct chunk_json_s {
+    uint32_t nalBytes;
+    uint64_t time;
+    char gotTime;
+} chunk_json;
+
+void chunk_json__field( void *opaque, int depth, char *key, int keyLen, char type, int64_t num, char *str, int strLen ) {
+    chunk_json *self = (chunk_json *) opaque;
+    if( depth != 1 || type != 4 ) return;
+    if( keyLen == 8 && !memcmp( key, "nalBytes", 8 ) ) self->nalBytes = num;
+    else if( keyLen == 4 && !memcmp( key, "time", 4 ) ) {
+        self->time = num;
+        self->gotTime = 1;
+    }
+}
+
+// Value of v as stored little endian; the same call converts to and from the wire order
+static uint16_t le16( uint16_t v ) {
+    uint8_t *b = (uint8_t *) &v;
+    return (uint16_t) ( b[0] | b[1] << 8 );
+}
+
+static uint32_t le32( uint32_t v ) {
+    uint8_t *b = (uint8_t *) &v;
+    return (uint32_t) b[0] | (uint32_t) b[1] << 8 | (uint32_t) b[2] << 16 | (uint32_t) b[3] << 24;
+}
+
+static uint64_t le64( uint64_t v ) {
+    uint8_t *b = (uint8_t *) &v;
+    uint64_t res = 0;
+    for( int i=7;i>=0;i-- ) res = res << 8 | b[i];
+    return res;
+}
+
+// Between host order and wire order, either way
+static void chunk_header__swap( chunk_header *head ) {
+    head->headerLen = le16( head->headerLen );
+    head->flags = le16( head->flags );
+    head->streamId = le32( head->streamId );
+    head->nalBytes = le32( head->nalBytes );
+    head->time = le64( head->time );
+}
+
+char chunk_header__is( char *buf, int size ) {
+    return size >= (int) sizeof( chunk_header ) && (uint8_t) buf[0] == CHUNK_MAGIC0 && buf[1] == CHUNK_MAGIC1 && buf[2] == CHUNK_MAGIC2;
+}
+
+// Where the NAL starts in a received message: after a binary chunk_header, after the 2 byte
+// length and JSON header, or at 0 for a bare NAL. -1 when the header does not fit the message.
+int chunk__unframe( char *buf, int size, uint32_t *nalBytes, uint64_t *time ) {
+    *nalBytes = 0;
+    *time = 0;
+    if( chunk_header__is( buf, size ) ) {
+        chunk_header head;
+        memcpy( &head, buf, sizeof( head ) );
+        chunk_header__swap( &head );
+        if( head.headerLen < sizeof( head ) || head.headerLen > size ) {
+            fprintf(stderr, "Bad chunk header; length %i in a message of %i\n", head.headerLen, size );
+            return -1;
+        }
+        *nalBytes = head.nalBytes;
+        *time = head.time;
+        return head.headerLen;
+    }
+    if( size < 3 || buf[2] != '{' ) return 0;
     
-    int err = 0;
-    node_hash *root = parse( &buf[3], jsonLen, NULL, &err );
-    if( !err ) {
-        node_str *nalBytesNode = ( node_str * ) node_hash__get( root, "nalBytes", 8 );
-        uint32_t nalBytes = nodetol( nalBytesNode );
-        if( nalBytes && nalBytes != ( size - dataStart ) ) {
-            printf("JSON size doesn't match data payload; %li != %li\n", (long) nalBytes, (long) size - dataStart );
+    uint16_t jsonLen;
+    memcpy( &jsonLen, buf, 2 );
+    if( jsonLen + 2 > size ) {
+        fprintf(stderr, "Bad JSON header; length %i in a message of %i\n", jsonLen, size );
+        return -1;
+    }
+    //printf("Size: %i, JSON: %.*s\n", size, jsonLen, &buf[2] );
+    if( !chunk__json_header( &buf[2], jsonLen, nalBytes, time ) ) {
+        printf("JSON has no time node\n");
+    }
+    return jsonLen + 2;
+}
+
+// Receives chunks with a binary chunk_header, the older length and JSON header, or none
+// Returns NULL on a socket error or an empty message; malformed messages are skipped
+chunk *mynano__recv_chunk( int n ) {
+    while( 1 ) {
+        char *buf = NULL;
+        int size = nn_recv( n, &buf, NN_MSG, 0 );
+        if( !size ) return NULL;
+        if( size < 0 ) { fprintf(stderr, "nn_recv err %i\n", size ); return NULL; }
+        
+        //printf("Received nanomsg chunk of size %i\n", size );
+        
+        uint32_t nalBytes;
+        uint64_t time;
+        int dataStart = chunk__unframe( buf, size, &nalBytes, &time );
+        if( dataStart < 0 || dataStart + 5 > size ) {
+            fprintf(stderr, "Skipping malformed message of %i bytes\n", size );
+            nn_freemsg( buf );
+            continue;
         }
-        node_str *timeNode = (node_str *) node_hash__get( root, "time", 4 );
-        if( timeNode ) {
-            uint64_t time = nodetoll( timeNode );
-            c->time = time;
-            uint64_t now = now_msec();
-            long dif = now_msec() - time;
-            //printf("Time str: %.*s\n", timeNode->len, timeNode->str );
-            //printf("MS dif: %lli %lli %li\n", (long long) time, (long long) now, dif );
+        if( nalBytes && nalBytes != ( size - dataStart ) ) {
+            printf("Header size doesn't match data payload; %li != %li\n", (long) nalBytes, (long) size - dataStart );
         }
-        else {
-            printf("JSON has no time node\n");
+        
+        // Room for the decoder to read past the NAL; realloc grows large messages in place
+        chunk *c = calloc( sizeof( chunk ), 1 );
+        char *padded = nn_reallocmsg( buf, size + CHUNK_PADDING );
+        if( padded ) {
+            buf = padded;
+            memset( buf + size, 0, CHUNK_PADDING );
+            c->pad = CHUNK_PADDING;
         }
-        node_hash__delete( root );
+        c->time = time;
+        c->size = size - dataStart;
+        c->rawptr = buf;
+        c->data = &buf[ dataStart ];
+        c->type = c->data[4];
+        c->dtype = 1;
+        //printf("%x %x %x %x %x\n", buffer[0], buffer[1], buffer[2], buffer[3], buffer[4] );
+        chunk__dump( c );
+        return c;
     }
-    
-    
-    c->size = size - dataStart;
-    c->rawptr = buf;
-    c->data = &buf[ dataStart ];
-    c->type = buf[ 4 + dataStart ];
-    c->dtype = 1;
-    //printf("%x %x %x %x %x\n", buffer[0], buffer[1], buffer[2], buffer[3], buffer[4] );
-    chunk__dump( c );
-    return c;
 }
 
 void mynano__send_chunk( int n, chunk *c ) {
     nn_send( n, c->data, c->size, 0 );
 }
 
+void chunk_header__init( chunk_header *head, chunk *c, uint32_t streamId, uint64_t time ) {
+    memset( head, 0, sizeof( chunk_header ) );
+    head->magic[0] = CHUNK_MAGIC0;
+    head->magic[1] = CHUNK_MAGIC1;
+    head->magic[2] = CHUNK_MAGIC2;
+    head->version = CHUNK_HEADER_VERSION;
+    head->headerLen = sizeof( chunk_header );
+    if( chunk__isheader( c ) ) head->flags |= CHUNK_FLAG_HEADER;
+    if( c->easyType == 5 ) head->flags |= CHUNK_FLAG_KEY;
+    head->streamId = streamId;
+    head->nalBytes = c->size;
+    head->time = time;
+}
+
+// Header for c as chunk__unframe reads it; binary selects chunk_header over JSON. Returns the
+// length of the header written to buf, which must hold 100 bytes.
+int chunk__frame_header( char *buf, chunk *c, char binary, uint32_t streamId, uint64_t time ) {
+    if( binary ) {
+        chunk_header head;
+        chunk_header__init( &head, c, streamId, time );
+        chunk_header__swap( &head );
+        memcpy( buf, &head, sizeof( head ) );
+        return sizeof( head );
+    }
+    int jlen = snprintf( buf + 2, 98, "{\"nalBytes\":%lu,\"time\":%llu}", (unsigned long) c->size, (unsigned long long) time );
+    uint16_t jlen2 = jlen;
+    memcpy( buf, &jlen2, 2 );
+    return jlen + 2;
+}
+
+// Send a chunk the way mynano__recv_chunk expects it. Header and NAL go out as one message
+// without being copied together.
+void mynano__send_chunk_framed( int n, chunk *c, char binary, uint32_t streamId, uint64_t time ) {
+    char head[100];
+    struct nn_iovec iov[2];
+    iov[0].iov_base = head;
+    iov[0].iov_len = chunk__frame_header( head, c, binary, streamId, time );
+    iov[1].iov_base = c->data;
+    iov[1].iov_len = c->size;
+    struct nn_msghdr msg;
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    nn_sendmsg( n, &msg, 0 );
+}
+
 void myzmq__send_chunk( myzmq *z, chunk *c ) {
     zmq_send( z->socket, c->data, c->size, 0 );
 }
 
+// The header and the NAL go out as two parts of one zmq message
+void myzmq__send_chunk_framed( myzmq *z, chunk *c, char binary, uint32_t streamId, uint64_t time ) {
+    char head[100];
+    int headLen = chunk__frame_header( head, c, binary, streamId, time );
+    zmq_send( z->socket, head, headLen, ZMQ_SNDMORE );
+    zmq_send( z->socket, c->data, c->size, 0 );
+}
+
 void myzmq__send( myzmq *z, void *data, int size ) {
     zmq_send( z->socket, data, size, 0 );
 }
@@ -189,27 +360,68 @@ void mynano__send( int n, void *data, int size ) {
 
 chunk *read_chunk( FILE *fh );
 
-void tracker__del( chunk_tracker *tracker ) {
-    chunk *cur = tracker->curchunk;
-    while( cur ) {
-        chunk *next = cur->next;
-        chunk__del( cur );
-        cur = next;
-    }
-    free( tracker );
-}
-
 void tracker__add_chunk( chunk_tracker *tracker, chunk *c ) {
-    chunk *curchunk = tracker->curchunk;
-    if( !curchunk ) {
-        tracker->curchunk = c;
+    if( tracker->watch ) tracker->watch( tracker->watchOpaque, c );
+    c->next = NULL;
+    if( !tracker->curchunk ) {
+        tracker->curchunk = tracker->tail = c;
         tracker->pos = 0; // shouldn't be needed
-        return;
     }
-    while( curchunk->next ) {
-        curchunk = curchunk->next;
+    else {
+        tracker->tail->next = c;
+        tracker->tail = c;
     }
-    curchunk->next = c;
+    tracker->count++;
+    tracker->bytes += c->size;
+}
+
+// Have watch called with every chunk queued from now on
+void tracker__watch( chunk_tracker *tracker, void (*watch)( void *opaque, chunk *c ), void *opaque ) {
+    tracker->watch = watch;
+    tracker->watchOpaque = opaque;
+}
+
+chunk *tracker__peek( chunk_tracker *tracker ) {
+    return tracker->curchunk;
+}
+
+// Remove the chunk at the head of the queue and return it; the caller owns it afterwards
+chunk *tracker__pop( chunk_tracker *tracker ) {
+    chunk *c = tracker->curchunk;
+    if( !c ) return NULL;
+    tracker->curchunk = c->next;
+    if( !c->next ) tracker->tail = NULL;
+    c->next = NULL;
+    tracker->pos = 0;
+    tracker->count--;
+    tracker->bytes -= c->size;
+    return c;
+}
+
+// First queued chunk of the given NAL type, ex: 7 for the SPS
+chunk *tracker__find_type( chunk_tracker *tracker, char easyType ) {
+    for( chunk *c = tracker->curchunk; c; c = c->next ) {
+        if( c->easyType == easyType ) return c;
+    }
+    return NULL;
+}
+
+int tracker__depth( chunk_tracker *tracker ) {
+    return tracker->count;
+}
+
+uint64_t tracker__bytes( chunk_tracker *tracker ) {
+    return tracker->bytes;
+}
+
+void tracker__clear( chunk_tracker *tracker ) {
+    chunk *c;
+    while( ( c = tracker__pop( tracker ) ) ) chunk__del( c );
+}
+
+void tracker__del( chunk_tracker *tracker ) {
+    tracker__clear( tracker );
+    free( tracker );
 }
 
 void chunk__write( chunk *c, FILE *fh );
@@ -223,24 +435,23 @@ void tracker__write_file( chunk_tracker *tracker, FILE *fh ) {
     }
 }
 
-void tracker__myzmq__send_chunks( chunk_tracker *tracker, myzmq *z ) {
-    chunk *c = tracker->curchunk;
-    while( c ) {
-        myzmq__send_chunk( z, c );
-        c = c->next;
+// framing: 0 for bare NALs, 1 for the JSON header, 2 for chunk_header
+void tracker__myzmq__send_chunks( chunk_tracker *tracker, myzmq *z, int framing ) {
+    chunk *c;
+    while( ( c = tracker__pop( tracker ) ) ) {
+        if( framing ) myzmq__send_chunk_framed( z, c, framing == 2, 0, now_msec() );
+        else myzmq__send_chunk( z, c );
+        chunk__del( c );
     }
-    tracker->curchunk = NULL;
-    tracker->pos = 0;
 }
 
-void tracker__mynano__send_chunks( chunk_tracker *tracker, int n ) {
-    chunk *c = tracker->curchunk;
-    while( c ) {
-        mynano__send_chunk( n, c );
-        c = c->next;
+void tracker__mynano__send_chunks( chunk_tracker *tracker, int n, int framing ) {
+    chunk *c;
+    while( ( c = tracker__pop( tracker ) ) ) {
+        if( framing ) mynano__send_chunk_framed( n, c, framing == 2, 0, now_msec() );
+        else mynano__send_chunk( n, c );
+        chunk__del( c );
     }
-    tracker->curchunk = NULL;
-    tracker->pos = 0;
 }
 
 char tracker__read_headers( chunk_tracker *tracker, FILE *fh ) {
@@ -310,11 +521,13 @@ char tracker__mynano__recv_headers( chunk_tracker *tracker, int n ) {
     return 0;
 }
 
+// The tracker__*recv_frame* functions return the queue depth after adding the chunk, or 0 on failure
+
 int tracker__read_frame( chunk_tracker *tracker, FILE *fh ) {
     chunk *c = read_chunk_non_header( fh );
     if( c ) {
         tracker__add_chunk( tracker, c );
-        return 1;
+        return tracker->count;
     }
     printf("Could not fetch frame chunk\n");
     return 0;
@@ -324,7 +537,7 @@ int tracker__myzmq__recv_frame( chunk_tracker *tracker, myzmq *z ) {
     chunk *c = myzmq__recv_chunk( z );
     if( c ) {
         tracker__add_chunk( tracker, c );
-        return 1;
+        return tracker->count;
     }
     printf("Could not fetch frame chunk\n");
     return 0;
@@ -335,12 +548,31 @@ int tracker__mynano__recv_frame( chunk_tracker *tracker, int n ) {
     if( c ) {
         tracker__add_chunk( tracker, c );
         //printf("Frame type %i\n", c->easyType );
-        return 1;
+        return tracker->count;
     }
     printf("Could not fetch frame chunk\n");
     return 0;
 }
 
+int tracker__myzmq__recv_frame_non_header( chunk_tracker *tracker, myzmq *z, uint64_t *time ) {
+    while( 1 ) {
+        chunk *c = myzmq__recv_chunk( z );
+        if( !c ) {
+            printf("Could not fetch frame chunk\n");
+            return 0;
+        }
+        if( chunk__isheader( c ) ) {
+            chunk__del( c );
+            continue;
+        }
+        if(time) *time = c->time;
+        tracker__add_chunk( tracker, c );
+        return tracker->count;
+    }
+    //unreachable
+    return 0;
+}
+
 int tracker__mynano__recv_frame_non_header( chunk_tracker *tracker, int n, uint64_t *time ) {
     while( 1 ) {
         chunk *c = mynano__recv_chunk( n );
@@ -348,16 +580,20 @@ int tracker__mynano__recv_frame_non_header( chunk_tracker *tracker, int n, uint6
             printf("Could not fetch frame chunk\n");
             return 0;
         }
-        if( chunk__isheader( c ) ) continue;
+        if( chunk__isheader( c ) ) {
+            chunk__del( c );
+            continue;
+        }
         if(time) *time = c->time;
         tracker__add_chunk( tracker, c );
-        return 1;
+        return tracker->count;
     }
     //unreachable
     return 0;
 }
 
-struct timespec *lastI = NULL, *nextI = NULL;
+// Per thread so each stream receiving on its own thread times its own I frames
+_Thread_local struct timespec *lastI = NULL, *nextI = NULL;
 char *naltypes[9] = {
     NULL, // 0
     NULL, // 1
@@ -382,6 +618,7 @@ void chunk__dump( chunk *c ) {
     int ref_idc = ( t & 0x60 ) >> 5;
     int type = ( t & 0x1F );
     c->easyType = type;
+    c->refIdc = ref_idc;
     if( type == 1 ) {
         //if( ref_idc ) printf(".");
         //else printf("x");
@@ -428,28 +665,35 @@ chunk *read_chunk( FILE *fh ) {
     if( !read ) return NULL;
     if(  m[2] == '{' ) { // b1 = size byte 1, b2 = size byte 2, b3 = {, b4 = first byte of json
         uint16_t size = * ( ( uint16_t * ) m );
-        char *jsonbuffer = malloc( size );
-        jsonbuffer[0] = '{';
-        jsonbuffer[1] = m[3];
-        fread( jsonbuffer + 2, 1, size - 2, fh );
         
-        //printf("JSON:%.*s\n", size, jsonbuffer );
-        // handle the JSON
-        int err = 0;
-        node_hash *root = parse( jsonbuffer, size, NULL, &err );
-        if( !err ) {
-            node_str *nalBytesNode = ( node_str * ) node_hash__get( root, "nalBytes", 8 );
-            uint32_t nalBytes = nodetol( nalBytesNode );
-            node_hash__delete( root );
+        // The JSON is parsed as it is read, a piece at a time
+        chunk_json json = { 0 };
+        jstream js;
+        jstream__init( &js, chunk_json__field, &json );
+        jstream__feed( &js, &m[2], 2 );
+        char piece[ 256 ];
+        for( int left = size - 2; left > 0; ) {
+            int want = left < (int) sizeof( piece ) ? left : (int) sizeof( piece );
+            int got = fread( piece, 1, want, fh );
+            if( got <= 0 ) return NULL;
+            jstream__feed( &js, piece, got );
+            left -= got;
+        }
+        uint32_t nalBytes = json.nalBytes;
+        uint64_t time = json.time;
+        if( nalBytes ) {
             //printf("nal bytes: %lli\n", (long long) nalBytes );
             
-            char *naldata = malloc( nalBytes );
+            char *naldata = malloc( nalBytes + CHUNK_PADDING );
             fread( naldata, 1, nalBytes, fh );
+            memset( naldata + nalBytes, 0, CHUNK_PADDING );
             
             chunk *c = calloc( sizeof( chunk ), 1 );
             c->data = naldata;
+            c->pad = CHUNK_PADDING;
             c->type = naldata[4];
             c->size = nalBytes;
+            c->time = time;
             c->dtype = 0;
             chunk__dump( c );
             return c;
@@ -510,6 +754,10 @@ chunk *read_chunk( FILE *fh ) {
                 c->data = buffer;
                 c->type = buffer[4];
                 c->size = bufferpos;
+                if( buffersize - bufferpos >= CHUNK_PADDING ) {
+                    memset( &buffer[ bufferpos ], 0, CHUNK_PADDING );
+                    c->pad = CHUNK_PADDING;
+                }
                 c->dtype = 0;
                 chunk__dump( c );
                 return c;
@@ -545,7 +793,5 @@ void chunk__write( chunk *c, FILE *fh ) {
 
 chunk_tracker *tracker__new() {
     chunk_tracker *tracker = calloc( sizeof( chunk_tracker ), 1 );
-    tracker->curchunk = NULL;
-    tracker->pos = 0;
     return tracker;
 }
\ No newline at end of file
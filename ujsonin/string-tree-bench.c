@@ -0,0 +1,105 @@
+// Copyright (C) 2020 David Helkowski
+// MIT License
+//
+// Compares string_tree against the red-black tree of fnv1a buckets it used to be, which is
+// kept here as rb_tree. Each round builds a table of n keys, looks every key up a few times
+// and frees the table, like parsing and reading one JSON hash does.
+//
+// make bench && ./string-tree-bench
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include"string-tree.h"
+#include"red_black_tree.h"
+
+static int IntComp( const void *a, const void *b ) {
+    if( *(uint32_t *) a > *(uint32_t *) b ) return 1;
+    if( *(uint32_t *) a < *(uint32_t *) b ) return -1;
+    return 0;
+}
+static void IntDest( void *a ) { free( a ); }
+static void InfoDest( void *a ) { snode__delete( (snode *) a ); }
+static void NoPrint( const void *a ) {}
+static void NoInfoPrint( void *a ) {}
+
+static rb_red_blk_tree *rb_tree__new() {
+    return RBTreeCreate( IntComp, IntDest, InfoDest, NoPrint, NoInfoPrint );
+}
+
+static snode *rb_tree__get( rb_red_blk_tree *tree, char *key, int keylen ) {
+    uint32_t hash = fnv1a_len( key, keylen );
+    rb_red_blk_node *rbnode = RBExactQuery( tree, &hash );
+    if( !rbnode ) return NULL;
+    for( snode *node = (snode *) rbnode->info; node; node = node->next ) {
+        if( keylen == node->strlen && !strncmp( node->str, key, keylen ) ) return node;
+    }
+    return NULL;
+}
+
+static void rb_tree__store( rb_red_blk_tree *tree, char *key, int keylen, void *data ) {
+    snode *cur = rb_tree__get( tree, key, keylen );
+    if( cur ) {
+        while( cur->next ) cur = cur->next;
+        cur->next = snode__new_len( key, keylen, data, 0, NULL );
+        return;
+    }
+    uint32_t *hash = malloc( sizeof( uint32_t ) );
+    *hash = fnv1a_len( key, keylen );
+    RBTreeInsert( tree, hash, snode__new_len( key, keylen, data, 0, NULL ) );
+}
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define LOOKUPS 4
+
+static void bench( int n, int rounds ) {
+    char (*keys)[16] = malloc( 16 * n );
+    int *lens = malloc( sizeof( int ) * n );
+    for( int i=0;i<n;i++ ) lens[i] = snprintf( keys[i], 16, "key%i", i );
+
+    long sum = 0;
+    double start = now_sec();
+    for( int r=0;r<rounds;r++ ) {
+        rb_red_blk_tree *tree = rb_tree__new();
+        for( int i=0;i<n;i++ ) rb_tree__store( tree, keys[i], lens[i], (void *) (long) ( i + 1 ) );
+        for( int j=0;j<LOOKUPS;j++ ) {
+            for( int i=0;i<n;i++ ) sum += (long) rb_tree__get( tree, keys[i], lens[i] )->data;
+        }
+        RBTreeDestroy( tree );
+    }
+    double rbTime = now_sec() - start;
+
+    start = now_sec();
+    for( int r=0;r<rounds;r++ ) {
+        string_tree *tree = string_tree__new();
+        char type;
+        for( int i=0;i<n;i++ ) string_tree__store_len( tree, keys[i], lens[i], (void *) (long) ( i + 1 ), 0 );
+        for( int j=0;j<LOOKUPS;j++ ) {
+            for( int i=0;i<n;i++ ) sum -= (long) string_tree__get_len( tree, keys[i], lens[i], &type );
+        }
+        string_tree__delete( tree );
+    }
+    double flatTime = now_sec() - start;
+
+    double ops = (double) rounds * n;
+    printf("%4i keys: rb tree %7.1f ns/key, flat %7.1f ns/key, %5.2fx%s\n", n,
+        rbTime / ops * 1e9, flatTime / ops * 1e9, rbTime / flatTime, sum ? " ( mismatch! )" : "" );
+    free( keys );
+    free( lens );
+}
+
+int main( int argc, char *argv[] ) {
+    int rounds = argc > 1 ? atoi( argv[1] ) : 200000;
+    int sizes[] = { 2, 4, 6, 8, 16, 64, 256 };
+    for( int i=0;i<(int)( sizeof( sizes ) / sizeof( sizes[0] ) );i++ ) {
+        int n = sizes[i];
+        bench( n, rounds * 6 / n + 1 );
+    }
+    return 0;
+}
@@ -2,7 +2,7 @@
 
 #include "string-tree.h"
 #include<string.h>
-#include"red_black_tree.h"
+#include<stdlib.h>
 
 uint32_t fnv1a_len( char *str, int strlen ) {
 	uint32_t hval = 0;
@@ -18,55 +18,75 @@ uint32_t fnv1a_len( char *str, int strlen ) {
     return hval;
 }
 
-void string_tree__delkey_len( string_tree *self, char *key, int keylen ) {
-	uint32_t hash = fnv1a_len( key, keylen );
-	rb_red_blk_node* rbnode = RBExactQuery( (rb_red_blk_tree *) self->tree, &hash );
-	
-	// We unfortunately cannot just delete the rbnode; as multiple keys may hash to this same value
-	//if( rbnode ) RBDelete( (rb_red_blk_tree *) self->tree, rbnode ); // automatically deletes info nodes
+static char snode__matches( snode *node, char *key, int keylen ) {
+	return node->str && node->strlen == keylen && !memcmp( node->str, key, keylen );
+}
+
+// Slot index for hash; linear probing from there
+static void string_tree__index( string_tree *self, int i ) {
+	uint32_t slot = self->hashes[ i ] & self->slotMask;
+	while( self->slots[ slot ] != -1 ) slot = ( slot + 1 ) & self->slotMask;
+	self->slots[ slot ] = i;
+}
+
+static void string_tree__grow( string_tree *self ) {
+	int cap = self->cap * 2;
+	snode *entries = ( snode * ) malloc( sizeof( snode ) * cap );
+	memcpy( entries, self->entries, sizeof( snode ) * self->count );
+	if( self->entries != self->inlineEntries ) free( self->entries );
+	self->entries = entries;
+	self->cap = cap;
 	
-	if( !rbnode ) { return; }
-	snode *node = (snode *) rbnode->info;
-	snode *prev = NULL;
-	while( node ) {
-	    snode *next = node->next;
-	    int delete = 0;
-	    if( node->strlen ) {
-			if( keylen == node->strlen && !strncmp( node->str, key, node->strlen ) ) delete = 1;
-		}
-		else {
-			int nslen = strlen( node->str );
-			if( nslen == keylen && !strncmp( node->str, key, keylen ) ) delete = 1;
-		}
-		if( delete ) {
-		    free( node );// destroy the snode
-		}
-		else {
-            if( prev ) prev->next = node;
-            else rbnode->info = node;
-            prev = node;
-        }
-		node = next;
-	}
-	if( prev ) {
-	    prev->next = NULL;
-	}
+	// small tables are scanned without hashing; hashes are filled in on leaving them
+	uint32_t *hashes = ( uint32_t * ) malloc( sizeof( uint32_t ) * cap );
+	if( self->hashes ) memcpy( hashes, self->hashes, sizeof( uint32_t ) * self->count );
 	else {
-	    rbnode->info = NULL;
+		for( int i=0;i<self->count;i++ ) hashes[i] = fnv1a_len( entries[i].str, entries[i].str ? entries[i].strlen : 0 );
+	}
+	free( self->hashes );
+	self->hashes = hashes;
+	
+	// twice as many slots as entries keeps probe runs short
+	free( self->slots );
+	self->slotMask = cap * 2 - 1;
+	self->slots = ( int32_t * ) malloc( sizeof( int32_t ) * cap * 2 );
+	memset( self->slots, 0xff, sizeof( int32_t ) * cap * 2 );
+	for( int i=0;i<self->count;i++ ) string_tree__index( self, i );
+}
+
+void string_tree__delkey_len( string_tree *self, char *key, int keylen ) {
+	// The entry stays in place with no key so the probe runs through it still work
+	for( int i=0;i<self->count;i++ ) {
+		if( snode__matches( &self->entries[i], key, keylen ) ) self->entries[i].str = NULL;
 	}
 }
 
 string_tree *string_tree__new() {
-    string_tree *self = ( string_tree * ) malloc( sizeof( string_tree ) );
-	self->tree = (void *) RBTreeCreate(IntComp,IntDest,InfoDest,IntPrint,InfoPrint);
+	string_tree *self = ( string_tree * ) malloc( sizeof( string_tree ) );
+	self->count = 0;
+	self->cap = STRING_TREE_INLINE;
+	self->entries = self->inlineEntries;
+	self->hashes = NULL;
+	self->slots = NULL;
+	self->slotMask = 0;
 	return self;
 }
 
 void string_tree__delete( string_tree *self ) {
-	RBTreeDestroy( (rb_red_blk_tree *) self->tree );
+	if( self->entries != self->inlineEntries ) free( self->entries );
+	free( self->hashes );
+	free( self->slots );
 	free( self );
 }
 
+// Delete the table along with every value stored in it, values stored under a repeated key included
+void string_tree__delete_with( string_tree *self, void (*freeData)( void *data ) ) {
+	for( int i=0;i<self->count;i++ ) {
+		if( self->entries[i].str ) freeData( self->entries[i].data );
+	}
+	string_tree__delete( self );
+}
+
 void *string_tree__get_len( string_tree *self, char *key, int keylen, char *dataType ) {
 	//printf("Getting %s\n", key );
 	snode *node = string_tree__rawget_len( self, key, keylen );
@@ -78,61 +98,37 @@ void *string_tree__get_len( string_tree *self, char *key, int keylen, char *data
 	return node->data;
 }
 
+// First entry stored under key
 snode *string_tree__rawget_len( string_tree *self, char *key, int keylen ) {
-	//printf("Attempting to get node %s\n", key );
-	uint32_t hash = fnv1a_len( key, keylen );
-	rb_red_blk_node* rbnode = RBExactQuery( (rb_red_blk_tree *) self->tree, &hash );
-	if( !rbnode ) { return 0; }
-	//printf("Found rbnode\n");
-	snode *node = (snode *) rbnode->info;
-	//printf("got %i\n", (int) node );
-	while( node ) {
-		if( node->strlen ) {
-			if( keylen == node->strlen && !strncmp( node->str, key, node->strlen ) ) return node;
+	if( !self->slots ) {
+		for( int i=0;i<self->count;i++ ) {
+			if( snode__matches( &self->entries[i], key, keylen ) ) return &self->entries[i];
 		}
-		else {
-			int nslen = strlen( node->str );
-			if( nslen == keylen && !strncmp( node->str, key, keylen ) ) return node;
-		}
-		node = node->next;
+		return NULL;
 	}
-	
-	//printf("ret\n");
-	return NULL;
-}
-
-void string_tree__store_len( string_tree *self, char *key, int keylen, void *node, char dataType ) {
 	uint32_t hash = fnv1a_len( key, keylen );
-	snode *curnode = string_tree__rawget_len( self, key, keylen );
-	if( curnode ) {
-		//snode *next = curnode->next;
-		while( curnode->next ) curnode = curnode->next;
-		
-		snode *newnode = snode__new_len( key, keylen, node, dataType, NULL );
-		curnode->next = newnode;
-	}
-	else {
-		curnode = snode__new_len( key, keylen, node, dataType, NULL );
-		uint32_t *hdup = malloc( sizeof( uint32_t ) );
-		*hdup = hash;
-		RBTreeInsert( (rb_red_blk_tree *) self->tree, hdup, curnode );
+	uint32_t slot = hash & self->slotMask;
+	int32_t found = -1;
+	// duplicates of a key sit further along the run; keep the earliest
+	for( int32_t i; ( i = self->slots[ slot ] ) != -1; slot = ( slot + 1 ) & self->slotMask ) {
+		if( self->hashes[i] == hash && snode__matches( &self->entries[i], key, keylen ) && ( found == -1 || i < found ) ) found = i;
 	}
+	return found == -1 ? NULL : &self->entries[ found ];
 }
 
-void IntDest(void* a) {
-	free((uint32_t*)a);
-}
-int IntComp(const void* a,const void* b) {
-  if( *(uint32_t*)a > *(uint32_t*)b) return(1);
-  if( *(uint32_t*)a < *(uint32_t*)b) return(-1);
-  return(0);
-}
-void IntPrint(const void* a) {
-}
-void InfoPrint(void* a) {
-}
-void InfoDest(void *a){
-	free( a );
+// Storing a key again keeps the earlier value for lookups; getkeys lists the key once
+void string_tree__store_len( string_tree *self, char *key, int keylen, void *node, char dataType ) {
+	if( self->count == self->cap ) string_tree__grow( self );
+	int i = self->count++;
+	snode *entry = &self->entries[i];
+	entry->str = key;
+	entry->strlen = keylen;
+	entry->data = node;
+	entry->dataType = dataType;
+	entry->next = NULL;
+	if( !self->slots ) return;
+	self->hashes[i] = fnv1a_len( key, keylen );
+	string_tree__index( self, i );
 }
 
 void snode__delete( snode *self ) {
@@ -205,13 +201,14 @@ void xjr_key_arr__delete( xjr_key_arr *self ) {
 
 xjr_key_arr *string_tree__getkeys( string_tree *self ) {
     xjr_key_arr *arr = xjr_key_arr__new();
-    TreeForEach1p( self->tree, string_tree__getkeys_rec, arr, NULL );
+    for( int i=0;i<self->count;i++ ) {
+        snode *snodex = &self->entries[i];
+        if( !snodex->str ) continue;
+        // a key stored again is listed at its first entry only
+        if( string_tree__rawget_len( self, snodex->str, snodex->strlen ) != snodex ) continue;
+        arr->sizes[ arr->count ] = snodex->strlen;
+        arr->items[ arr->count++ ] = snodex->str;
+        if( arr->count >= arr->max ) xjr_key_arr__double( arr );
+    }
     return arr;
 }
-void string_tree__getkeys_rec( void *snodeV, void *arrV ) {
-    snode *snodex = ( snode * ) snodeV;
-    xjr_key_arr *arr = ( xjr_key_arr * ) arrV;
-    arr->sizes[ arr->count ] = snodex->strlen;
-    arr->items[ arr->count++ ] = snodex->str;
-    if( arr->count >= arr->max ) xjr_key_arr__double( arr );
-}
@@ -43,21 +43,29 @@ xjr_key_arr *xjr_key_arr__new();
 void xjr_key_arr__double( xjr_key_arr *self );
 void xjr_key_arr__delete( xjr_key_arr *self );
 
+// Despite the name this is a flat table: entries in insertion order, looked up by a linear
+// scan while there are few of them and through an open addressing index of their fnv1a hashes
+// once there are more. JSON hashes rarely hold more than a handful of keys, so most tables
+// never leave the inline entries.
+#define STRING_TREE_INLINE 8
 struct string_tree_s {
-	void *tree;
+	int count; // entries used, deleted ones included
+	int cap;
+	snode *entries; // inlineEntries until the table outgrows them
+	uint32_t *hashes; // hash of each entry; NULL, like slots, while scanning is used
+	int32_t *slots; // entry index per slot, -1 when empty
+	uint32_t slotMask;
+	snode inlineEntries[ STRING_TREE_INLINE ];
 };
 typedef struct string_tree_s string_tree;
 snode *string_tree__rawget_len( string_tree *self, char *key, int keylen );
 string_tree *string_tree__new();
 void string_tree__delete( string_tree *self );
+void string_tree__delete_with( string_tree *self, void (*freeData)( void *data ) );
 void *string_tree__get_len( string_tree *self, char *key, int keylen, char *dataType );
 void string_tree__delkey_len( string_tree *self, char *key, int keylen );
 
 void string_tree__store_len( string_tree *self, char *key, int keylen, void *node, char dataType );
 
-void IntDest(void *); int IntComp(const void *,const void *);
-void IntPrint(const void* a); void InfoPrint(void *); void InfoDest(void *);
-
 xjr_key_arr *string_tree__getkeys( string_tree *self );
-void string_tree__getkeys_rec( void *snodeV, void *arrV );
 #endif
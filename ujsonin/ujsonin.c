@@ -4,6 +4,7 @@
 
 #include<stdio.h>
 #include<stdint.h>
+#include<string.h>
 #include"red_black_tree.h"
 #include"string-tree.h"
 
@@ -48,33 +49,90 @@ char *slurp_file( char *filename, int *outlen ) {
     return input;
 }
 
-static jnode *jnode__new( int type ) {
-    jnode *self = ( jnode * ) calloc( sizeof( jnode ), 1 );
+struct ujsonin_block_s {
+    ujsonin_block *next;
+};
+
+#define UJSONIN_BLOCK 4096
+
+void ujsonin_arena__init( ujsonin_arena *self, char *buf, int size ) {
+    self->buf = buf;
+    self->size = size;
+    self->extra = NULL;
+    ujsonin_arena__reset( self );
+}
+
+void ujsonin_arena__reset( ujsonin_arena *self ) {
+    while( self->extra ) {
+        ujsonin_block *next = self->extra->next;
+        free( self->extra );
+        self->extra = next;
+    }
+    self->cur = self->buf;
+    self->curSize = self->size;
+    self->curUsed = 0;
+}
+
+// Zeroed memory from the arena, or from calloc without one
+static void *ujsonin_alloc( ujsonin_arena *arena, int size ) {
+    if( !arena ) return calloc( size, 1 );
+    size = ( size + 7 ) & ~7;
+    if( arena->curUsed + size > arena->curSize ) {
+        int blockSize = size > UJSONIN_BLOCK ? size : UJSONIN_BLOCK;
+        ujsonin_block *block = ( ujsonin_block * ) malloc( sizeof( ujsonin_block ) + 8 + blockSize );
+        block->next = arena->extra;
+        arena->extra = block;
+        arena->cur = (char *) block + ( ( sizeof( ujsonin_block ) + 7 ) & ~7 );
+        arena->curSize = blockSize;
+        arena->curUsed = 0;
+    }
+    void *mem = arena->cur + arena->curUsed;
+    arena->curUsed += size;
+    memset( mem, 0, size );
+    return mem;
+}
+
+static jnode *jnode__new( int type, ujsonin_arena *arena ) {
+    jnode *self = ( jnode * ) ujsonin_alloc( arena, sizeof( jnode ) );
     self->type = type;
     return self;
 }
 
-static node_hash *node_hash__new() {
-    node_hash *self = ( node_hash * ) calloc( sizeof( node_hash ), 1 );
+static node_hash *node_hash__new( ujsonin_arena *arena ) {
+    node_hash *self = ( node_hash * ) ujsonin_alloc( arena, sizeof( node_hash ) );
     self->type = 1;
-    self->tree = string_tree__new();
+    if( !arena ) self->tree = string_tree__new();
     return self;
 }
 
-static node_str *node_str__new( char *str, int len, char type ) {
-    node_str *self = ( node_str * ) calloc( sizeof( node_str ), 1 );
+static node_str *node_str__new( char *str, int len, char type, ujsonin_arena *arena ) {
+    node_str *self = ( node_str * ) ujsonin_alloc( arena, sizeof( node_str ) );
     self->type = type; // 2 is str, 4 is number, 5 is a negative number
     self->str = str;
     self->len = len;
     return self;
 }
 
-static node_arr *node_arr__new() {
-    node_arr *self = ( node_arr * ) calloc( sizeof( node_arr ), 1 );
+static node_arr *node_arr__new( ujsonin_arena *arena ) {
+    node_arr *self = ( node_arr * ) ujsonin_alloc( arena, sizeof( node_arr ) );
     self->type = 3;
     return self;
 }
 
+// Keys of a hash whether it uses a tree or lives in an arena
+static xjr_key_arr *node_hash__keys( node_hash *self ) {
+    if( self->tree ) return string_tree__getkeys( self->tree );
+    xjr_key_arr *arr = xjr_key_arr__new();
+    for( hash_entry *e = self->head; e; e = e->next ) {
+        // a key stored again is listed at its first entry only, as with the tree
+        if( node_hash__get( self, e->key, e->keyLen ) != e->node ) continue;
+        arr->sizes[ arr->count ] = e->keyLen;
+        arr->items[ arr->count++ ] = e->key;
+        if( arr->count >= arr->max ) xjr_key_arr__double( arr );
+    }
+    return arr;
+}
+
 static void node_arr__add( node_arr *self, jnode *el ) {
     self->count++;
     if( !self->head ) {
@@ -86,7 +144,7 @@ static void node_arr__add( node_arr *self, jnode *el ) {
 }
 
 void node_hash__dump( node_hash *self, int depth ) {
-    xjr_key_arr *keys = string_tree__getkeys( self->tree );
+    xjr_key_arr *keys = node_hash__keys( self );
     printf("{\n");
     for( int i=0;i<keys->count;i++ ) {
         char *key = keys->items[i];
@@ -98,23 +156,21 @@ void node_hash__dump( node_hash *self, int depth ) {
     SPACES printf("}\n");
 }
 
+static void jnode__delete_value( void *data ) {
+    jnode *sub = (jnode *) data;
+    if( sub->type == 1 ) node_hash__delete( (node_hash *) sub );
+    else free( sub );
+}
+
 void node_hash__delete( node_hash *self ) {
-    xjr_key_arr *keys = string_tree__getkeys( self->tree );
-    for( int i=0;i<keys->count;i++ ) {
-        char *key = keys->items[i];
-        int len = keys->sizes[i];
-        jnode *sub = node_hash__get( self, key, len );
-        if( sub->type == 1 ) node_hash__delete( (node_hash *) sub );
-        else free( sub );
-    }
-    xjr_key_arr__delete( keys );
-    string_tree__delete( self->tree );
+    if( !self->tree ) return; // freed by resetting its arena
+    string_tree__delete_with( self->tree, jnode__delete_value );
     free( self );
 }
 
 void jnode__dump_to_makefile( jnode *self, char *prefix );
 void node_hash__dump_to_makefile( node_hash *self, char *prefix ) {
-    xjr_key_arr *keys = string_tree__getkeys( self->tree );
+    xjr_key_arr *keys = node_hash__keys( self );
     char pref2[ 100 ];
     for( int i=0;i<keys->count;i++ ) {
         char *key = keys->items[i];
@@ -182,61 +238,75 @@ void node_hash__store( node_hash *self, char *key, int keyLen, jnode *node ) {
     string_tree__store_len( self->tree, key, keyLen, (void *) node, 0 );
 }
 
+static void node_hash__put( node_hash *self, char *key, int keyLen, jnode *node, ujsonin_arena *arena ) {
+    if( self->tree ) {
+        node_hash__store( self, key, keyLen, node );
+        return;
+    }
+    hash_entry *e = ( hash_entry * ) ujsonin_alloc( arena, sizeof( hash_entry ) );
+    e->key = key;
+    e->keyLen = keyLen;
+    e->node = node;
+    if( self->tail ) self->tail->next = e;
+    else self->head = e;
+    self->tail = e;
+}
+
 jnode *node_hash__get( node_hash *self, char *key, int keyLen ) {
+    if( !self->tree ) {
+        // arena hashes are small; the first stored match wins as with the tree
+        for( hash_entry *e = self->head; e; e = e->next ) {
+            if( e->keyLen == keyLen && !memcmp( e->key, key, keyLen ) ) return e->node;
+        }
+        return NULL;
+    }
     char type;
     return (jnode *) string_tree__get_len( self->tree, key, keyLen, &type );
 }
 
 static char nullStr[2] = { 0, 0 };
 
-typedef struct handle_res_s {
-    int dest;
-    jnode *node;
-} handle_res;
-
-static handle_res *handle_res__new() {
-    handle_res *self = ( handle_res * ) calloc( sizeof( handle_res ), 1 );
-    return self;
-}
-
-static handle_res *handle_true( char *data, int *pos ) {
-    jnode *node = jnode__new( 6 );
-    handle_res *res = handle_res__new();
-    res->node = node;
-    return res;
+static jnode *handle_true( char *data, int *pos, ujsonin_arena *arena ) {
+    return jnode__new( 6, arena );
 }
 
-static handle_res *handle_false( char *data, int *pos ) {
-    jnode *node = jnode__new( 7 );
-    handle_res *res = handle_res__new();
-    res->node = node;
-    return res;
+static jnode *handle_false( char *data, int *pos, ujsonin_arena *arena ) {
+    return jnode__new( 7, arena );
 }
 
-static handle_res *handle_null( char *data, int *pos ) {
-    jnode *node = jnode__new( 8 );
-    handle_res *res = handle_res__new();
-    res->node = node;
-    return res;
+static jnode *handle_null( char *data, int *pos, ujsonin_arena *arena ) {
+    return jnode__new( 8, arena );
 }
 
-typedef handle_res* (*ahandler)(char *, int * ); 
+typedef jnode* (*ahandler)(char *, int *, ujsonin_arena * ); 
 
 string_tree *handlers;
 void ujsonin_init() {
+    if( handlers ) return; // already set up; parsers may be running on other threads
     handlers = string_tree__new();
     string_tree__store_len( handlers, "true", 4, (void *) &handle_true, 0 );
     string_tree__store_len( handlers, "false", 5, (void *) &handle_false, 0 );
     string_tree__store_len( handlers, "null", 4, (void *) &handle_null, 0 );
 }
 
+static node_hash *parse_in( char *data, int len, parser_state *beginState, int *err, ujsonin_arena *arena );
+
 node_hash *parse( char *data, int len, parser_state *beginState, int *err ) {
+    return parse_in( data, len, beginState, err, NULL );
+}
+
+// Parse with every node allocated from arena; the tree is dropped with ujsonin_arena__reset
+node_hash *parse_arena( char *data, int len, ujsonin_arena *arena, int *err ) {
+    return parse_in( data, len, NULL, err, arena );
+}
+
+static node_hash *parse_in( char *data, int len, parser_state *beginState, int *err, ujsonin_arena *arena ) {
     int pos = 1, keyLen, typeStart;
     int endstate = 0;
     uint8_t neg = 0;
     char *keyStart, *strStart, let;
     
-    node_hash *root = node_hash__new();
+    node_hash *root = node_hash__new( arena );
     jnode *cur = ( jnode * ) root;
     if( beginState ) {
         // If we start in the middle of a key or value, we must merge the previous value
@@ -323,9 +393,9 @@ Colon: SAFEGET(9)
 AfterColon: SAFEGET(10)
     if( let == '"' ) goto String1;
     if( let == '{' ) {
-        node_hash *newHash = node_hash__new();
+        node_hash *newHash = node_hash__new( arena );
         newHash->parent = cur;
-        if( cur->type == 1 ) node_hash__store( (node_hash *) cur, keyStart, keyLen, (jnode *) newHash );
+        if( cur->type == 1 ) node_hash__put( (node_hash *) cur, keyStart, keyLen, (jnode *) newHash, arena );
         if( cur->type == 3 ) node_arr__add( (node_arr *) cur, (jnode *) newHash );
         cur = (jnode *) newHash;
         goto Hash;
@@ -342,9 +412,9 @@ AfterColon: SAFEGET(10)
     if( let >= '0' && let <= '9' ) { neg=0; goto Number1; }
     if( let == '-' ) { neg=1; pos++; goto Number1; }
     if( let == '[' ) {
-        node_arr *newArr = node_arr__new();
+        node_arr *newArr = node_arr__new( arena );
         newArr->parent = cur;
-        if( cur->type == 1 ) node_hash__store( (node_hash *) cur, keyStart, keyLen, (jnode *) newArr );
+        if( cur->type == 1 ) node_hash__put( (node_hash *) cur, keyStart, keyLen, (jnode *) newArr, arena );
         if( cur->type == 3 ) node_arr__add( (node_arr *) cur, (jnode *) newArr );
         cur = (jnode *) newArr;
         goto AfterColon;
@@ -368,20 +438,18 @@ TypeX: SAFEGET(11)
         printf("disaster");
         exit(1);
     }
-    handle_res *res = (*handler)( data, &pos );
-    if( res == NULL ) {
+    jnode *typeNode = (*handler)( data, &pos, arena );
+    if( typeNode == NULL ) {
         printf("disaster");
         exit(1);
     }
-    if( res->dest == 0 ) {
-        if( cur->type == 1 ) {
-            node_hash__store( (node_hash *) cur, keyStart, keyLen, res->node );
-            goto AfterVal;
-        }
-        if( cur->type == 3 ) {
-            node_arr__add( (node_arr *) cur, res->node );
-            goto AfterColon;
-        }
+    if( cur->type == 1 ) {
+        node_hash__put( (node_hash *) cur, keyStart, keyLen, typeNode, arena );
+        goto AfterVal;
+    }
+    if( cur->type == 3 ) {
+        node_arr__add( (node_arr *) cur, typeNode );
+        goto AfterColon;
     }
     goto TypeX; // should never reach here
 /*AfterType: SAFEGET
@@ -408,9 +476,9 @@ NumberX: SAFEGET(16)
     //if( let == '.' ) goto AfterDot;
     if( let < '0' || let > '9' ) {
         int strLen = &data[pos-1] - strStart;
-        jnode *newStr = (jnode *) node_str__new( strStart, strLen, neg ? 5 : 4 );
+        jnode *newStr = (jnode *) node_str__new( strStart, strLen, neg ? 5 : 4, arena );
         if( cur->type == 1 ) {
-            node_hash__store( (node_hash *) cur, keyStart, keyLen, newStr );
+            node_hash__put( (node_hash *) cur, keyStart, keyLen, newStr, arena );
             goto AfterVal;
         }
         if( cur->type == 3 ) {
@@ -422,9 +490,9 @@ NumberX: SAFEGET(16)
 //AfterDot: SAFEGET
 String1: SAFEGET(17)
     if( let == '"' ) {
-        jnode *newStr = (jnode *) node_str__new( nullStr, 0, 2 );
+        jnode *newStr = (jnode *) node_str__new( nullStr, 0, 2, arena );
         if( cur->type == 1 ) {
-            node_hash__store( (node_hash *) cur, keyStart, keyLen, newStr );
+            node_hash__put( (node_hash *) cur, keyStart, keyLen, newStr, arena );
             goto AfterVal;
         }
         if( cur->type == 3 ) {
@@ -437,9 +505,9 @@ String1: SAFEGET(17)
 StringX: SAFEGET(18)
     if( let == '"' ) {
        int strLen = &data[pos-1] - strStart;
-       jnode *newStr = (jnode *) node_str__new( strStart, strLen, 2 );
+       jnode *newStr = (jnode *) node_str__new( strStart, strLen, 2, arena );
        if( cur->type == 1 ) {
-           node_hash__store( (node_hash *) cur, keyStart, keyLen, newStr );
+           node_hash__put( (node_hash *) cur, keyStart, keyLen, newStr, arena );
            goto AfterVal;
        }
        if( cur->type == 3 ) {
@@ -453,5 +521,279 @@ AfterVal: SAFE(19)
     // who cares about commas in between things; we can just ignore them :D
     goto Hash;
 Done:
+    // Where the data ran out; 0 when it ended between values. Pointers into data are not kept,
+    // so only states that hold nothing from earlier data can be resumed from. Use jstream to
+    // parse data that arrives in pieces.
+    if( beginState ) beginState->state = endstate;
     return root;
-}
\ No newline at end of file
+}
+
+// Pull the named integer fields of the outer hash straight out of data without building a
+// tree. Accepts the same keys, comments and separators parse does. Returns how many of the
+// fields were found; the rest are left with found 0.
+int parse_ints( char *data, int len, jint *fields, int count ) {
+    int pos = 0, depth = 0, found = 0;
+    char *key = NULL;
+    int keyLen = 0;
+    char inValue = 0;
+    for( int i=0;i<count;i++ ) fields[i].found = 0;
+    
+    while( pos < len && found < count ) {
+        char let = data[pos++];
+        if( let == '/' && pos < len ) {
+            if( data[pos] == '/' ) {
+                while( pos < len && data[pos] != 0x0a && data[pos] != 0x0d ) pos++;
+                continue;
+            }
+            if( data[pos] == '*' ) {
+                pos++;
+                while( pos + 1 < len && !( data[pos] == '*' && data[pos+1] == '/' ) ) pos++;
+                pos += 2;
+                continue;
+            }
+        }
+        if( let == '{' || let == '[' ) {
+            depth++;
+            inValue = ( let == '[' );
+            key = NULL;
+            continue;
+        }
+        if( let == '}' || let == ']' ) {
+            depth--;
+            inValue = 0;
+            key = NULL;
+            continue;
+        }
+        if( let == ':' ) {
+            inValue = 1;
+            continue;
+        }
+        if( let == '"' || let == '\'' ) {
+            char *start = &data[pos];
+            while( pos < len && data[pos] != let ) {
+                if( data[pos] == '\\' ) pos++;
+                pos++;
+            }
+            if( !inValue ) {
+                key = start;
+                keyLen = &data[pos] - start;
+            }
+            else {
+                inValue = 0;
+                key = NULL;
+            }
+            pos++;
+            continue;
+        }
+        if( let >= 'a' && let <= 'z' ) {
+            char *start = &data[pos-1];
+            while( pos < len && data[pos] != ':' && data[pos] != ' ' && data[pos] != '\t' && data[pos] != ',' && data[pos] != '}' ) pos++;
+            if( !inValue ) {
+                key = start;
+                keyLen = &data[pos] - start;
+            }
+            else {
+                inValue = 0; // true, false or null
+                key = NULL;
+            }
+            continue;
+        }
+        if( inValue && ( ( let >= '0' && let <= '9' ) || let == '-' ) ) {
+            char neg = ( let == '-' );
+            int64_t val = neg ? 0 : let - '0';
+            while( pos < len && data[pos] >= '0' && data[pos] <= '9' ) val = val * 10 + ( data[pos++] - '0' );
+            if( neg ) val = -val;
+            if( depth == 1 && key ) {
+                for( int i=0;i<count;i++ ) {
+                    jint *f = &fields[i];
+                    if( !f->found && f->keyLen == keyLen && !memcmp( f->key, key, keyLen ) ) {
+                        f->val = val;
+                        f->found = 1;
+                        found++;
+                        break;
+                    }
+                }
+            }
+            inValue = 0;
+            key = NULL;
+            continue;
+        }
+    }
+    return found;
+}
+
+enum {
+    JS_START, // before the outer {
+    JS_HASH, // waiting for a key or }
+    JS_QKEY, // in a quoted key
+    JS_KEY, // in an unquoted key
+    JS_COLON,
+    JS_VALUE, // after : or inside an array
+    JS_STR,
+    JS_NUM,
+    JS_WORD, // true, false or null
+    JS_SLASH, // / seen; comment or garbage
+    JS_LINE_COMMENT,
+    JS_BLOCK_COMMENT,
+    JS_BLOCK_STAR,
+    JS_DONE // outer hash closed
+};
+
+void jstream__init( jstream *self, jstream_cb cb, void *opaque ) {
+    memset( self, 0, sizeof( jstream ) );
+    self->cb = cb;
+    self->opaque = opaque;
+}
+
+char jstream__done( jstream *self ) {
+    return self->state == JS_DONE;
+}
+
+static char jstream__in_array( jstream *self ) {
+    return self->depth > 0 && ( self->arrays >> ( self->depth - 1 ) ) & 1;
+}
+
+// A value finished; hash members go to the callback, array elements are skipped
+static void jstream__value( jstream *self, char type ) {
+    if( !jstream__in_array( self ) ) {
+        self->cb( self->opaque, self->depth, self->key, self->keyLen, type, self->num, self->str, self->strLen );
+    }
+    self->state = jstream__in_array( self ) ? JS_VALUE : JS_HASH;
+}
+
+static void jstream__open( jstream *self, char isArray ) {
+    if( isArray ) self->arrays |= ( 1ull << self->depth );
+    else self->arrays &= ~( 1ull << self->depth );
+    self->depth++;
+    self->state = isArray ? JS_VALUE : JS_HASH;
+}
+
+static void jstream__close( jstream *self ) {
+    self->depth--;
+    if( !self->depth ) self->state = JS_DONE;
+    else self->state = jstream__in_array( self ) ? JS_VALUE : JS_HASH;
+}
+
+// Feed the next piece of input. Returns how many bytes were used; less than len only once the
+// outer hash has closed.
+int jstream__feed( jstream *self, char *data, int len ) {
+    int pos = 0;
+    while( pos < len ) {
+        if( self->state == JS_DONE ) return pos;
+        char let = data[pos++];
+        switch( self->state ) {
+            case JS_START:
+                if( let == '{' ) jstream__open( self, 0 );
+                break;
+            case JS_HASH:
+                if( let == '"' || let == '\'' ) {
+                    self->quote = let;
+                    self->keyLen = 0;
+                    self->state = JS_QKEY;
+                }
+                else if( let >= 'a' && let <= 'z' ) {
+                    self->key[0] = let;
+                    self->keyLen = 1;
+                    self->state = JS_KEY;
+                }
+                else if( let == '}' ) jstream__close( self );
+                else if( let == '/' ) {
+                    self->resume = JS_HASH;
+                    self->state = JS_SLASH;
+                }
+                break;
+            case JS_QKEY:
+                if( self->escape ) self->escape = 0;
+                else if( let == '\\' ) self->escape = 1;
+                else if( let == self->quote ) {
+                    self->state = JS_COLON;
+                    break;
+                }
+                if( self->keyLen < JSTREAM_KEY_MAX ) self->key[ self->keyLen++ ] = let;
+                break;
+            case JS_KEY:
+                if( let == ':' ) self->state = JS_VALUE;
+                else if( let == ' ' || let == '\t' ) self->state = JS_COLON;
+                else if( self->keyLen < JSTREAM_KEY_MAX ) self->key[ self->keyLen++ ] = let;
+                break;
+            case JS_COLON:
+                if( let == ':' ) self->state = JS_VALUE;
+                break;
+            case JS_VALUE:
+                if( let == '"' || let == '\'' ) {
+                    self->quote = let;
+                    self->strLen = 0;
+                    self->state = JS_STR;
+                }
+                else if( ( let >= '0' && let <= '9' ) || let == '-' ) {
+                    self->neg = ( let == '-' );
+                    self->num = self->neg ? 0 : let - '0';
+                    self->state = JS_NUM;
+                }
+                else if( let >= 'a' && let <= 'z' ) {
+                    self->str[0] = let;
+                    self->strLen = 1;
+                    self->state = JS_WORD;
+                }
+                else if( let == '{' ) jstream__open( self, 0 );
+                else if( let == '[' ) jstream__open( self, 1 );
+                else if( let == ']' && jstream__in_array( self ) ) jstream__close( self );
+                else if( let == '/' ) {
+                    self->resume = JS_VALUE;
+                    self->state = JS_SLASH;
+                }
+                break;
+            case JS_STR:
+                if( self->escape ) self->escape = 0;
+                else if( let == '\\' ) self->escape = 1;
+                else if( let == self->quote ) {
+                    self->num = 0;
+                    jstream__value( self, 2 );
+                    break;
+                }
+                if( self->strLen < JSTREAM_STR_MAX ) self->str[ self->strLen++ ] = let;
+                break;
+            case JS_NUM:
+                if( let >= '0' && let <= '9' ) {
+                    self->num = self->num * 10 + ( let - '0' );
+                    break;
+                }
+                if( self->neg ) self->num = -self->num;
+                self->strLen = 0;
+                jstream__value( self, 4 );
+                pos--; // the character after the number still needs handling
+                break;
+            case JS_WORD:
+                if( let >= 'a' && let <= 'z' ) {
+                    if( self->strLen < JSTREAM_STR_MAX ) self->str[ self->strLen++ ] = let;
+                    break;
+                }
+                char type = 8;
+                if( self->strLen == 4 && !memcmp( self->str, "true", 4 ) ) type = 6;
+                else if( self->strLen == 5 && !memcmp( self->str, "false", 5 ) ) type = 7;
+                self->num = ( type == 6 );
+                jstream__value( self, type );
+                pos--;
+                break;
+            case JS_SLASH:
+                if( let == '/' ) self->state = JS_LINE_COMMENT;
+                else if( let == '*' ) self->state = JS_BLOCK_COMMENT;
+                else {
+                    self->state = self->resume;
+                    pos--;
+                }
+                break;
+            case JS_LINE_COMMENT:
+                if( let == 0x0d || let == 0x0a ) self->state = self->resume;
+                break;
+            case JS_BLOCK_COMMENT:
+                if( let == '*' ) self->state = JS_BLOCK_STAR;
+                break;
+            case JS_BLOCK_STAR:
+                if( let == '/' ) self->state = self->resume;
+                else if( let != '*' ) self->state = JS_BLOCK_COMMENT;
+                break;
+        }
+    }
+    return pos;
+}
@@ -16,8 +16,18 @@ typedef struct jnode_s jnode;
 
 struct jnode_s { NODEBASE };
 
+typedef struct hash_entry_s hash_entry;
+struct hash_entry_s {
+    char *key;
+    int keyLen;
+    jnode *node;
+    hash_entry *next;
+};
+
 typedef struct node_hash_s { NODEBASE
-    string_tree *tree;
+    string_tree *tree; // NULL when the hash lives in an arena
+    hash_entry *head; // entries of a hash in an arena, in the order stored
+    hash_entry *tail;
 } node_hash;
 
 typedef struct node_str_s { NODEBASE
@@ -35,7 +45,61 @@ typedef struct parser_state_s {
     int state;
 } parser_state;
 
+// Memory a whole parse can live in. Starts in a caller supplied buffer; when that runs out
+// further blocks are malloced. Reset drops everything parsed into it at once.
+typedef struct ujsonin_block_s ujsonin_block;
+typedef struct ujsonin_arena_s {
+    char *buf;
+    int size;
+    char *cur; // block being filled; buf or the newest extra block
+    int curSize;
+    int curUsed;
+    ujsonin_block *extra;
+} ujsonin_arena;
+
+// A named integer pulled out by parse_ints
+typedef struct jint_s {
+    char *key;
+    int keyLen;
+    int64_t val;
+    char found;
+} jint;
+
+// Incremental parser; bytes are fed as they arrive and every value is handed to a callback
+// as soon as it is complete. Only the current key and string value are copied, so nothing the
+// size of the whole input is ever held. Keys and strings longer than the buffers are cut short.
+#define JSTREAM_KEY_MAX 64
+#define JSTREAM_STR_MAX 256
+
+// type: 2 string, 4 number, 6 true, 7 false, 8 null. depth is 1 for the outer hash.
+typedef void (*jstream_cb)( void *opaque, int depth, char *key, int keyLen, char type, int64_t num, char *str, int strLen );
+
+typedef struct jstream_s {
+    int state;
+    int depth;
+    uint64_t arrays; // bit n set when depth n+1 is an array
+    int resume; // state to go back to after a comment
+    char quote;
+    char escape;
+    char neg;
+    int64_t num;
+    char key[ JSTREAM_KEY_MAX ];
+    int keyLen;
+    char str[ JSTREAM_STR_MAX ];
+    int strLen;
+    jstream_cb cb;
+    void *opaque;
+} jstream;
+
+void jstream__init( jstream *self, jstream_cb cb, void *opaque );
+int jstream__feed( jstream *self, char *data, int len );
+char jstream__done( jstream *self );
+
 node_hash *parse( char *data, int len, parser_state *beginState, int *err );
+node_hash *parse_arena( char *data, int len, ujsonin_arena *arena, int *err );
+void ujsonin_arena__init( ujsonin_arena *self, char *buf, int size );
+void ujsonin_arena__reset( ujsonin_arena *self );
+int parse_ints( char *data, int len, jint *fields, int count );
 jnode *node_hash__get( node_hash *self, char *key, int keyLen );
 void jnode__dump( jnode *self, int depth );
 char *slurp_file( char *filename, int *outlen );
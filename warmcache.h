@@ -0,0 +1,265 @@
+// Copyright (c) 2020 David Helkowski
+// Warm start cache for a stream
+//
+// Keeps what a restarted decoder needs to come up without waiting on the device: the SEI, SPS
+// and PPS in force ( the SPS and PPS are the codec extradata ), the source and target size, and
+// the last whole IDR picture. The file is a warmcache_head followed by the four NALs in that
+// order, each with a 4 byte start code. Anything that does not check out on reading, a wrong
+// magic or version, a size or sum mismatch, NALs of the wrong type or an SPS that does not give
+// the stored size, makes warmcache__read fail so the caller falls back to live headers. Once the
+// stream is live its SPS and PPS are compared with the loaded ones; when they differ the cache is
+// marked stale so the caller can reopen the decoder from the live ones.
+
+#ifndef __WARMCACHE_H
+#define __WARMCACHE_H
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<sys/stat.h>
+
+#define WARMCACHE_MAGIC "h264warm"
+#define WARMCACHE_VERSION 1
+#define WARMCACHE_INTERVAL 10000 // ms between rewrites while the stream runs
+
+enum { WARM_SEI, WARM_SPS, WARM_PPS, WARM_KEY, WARM_NALS };
+
+typedef struct warmcache_head_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t bytes; // data after the head
+    uint32_t sum; // fnv1a of that data
+    int32_t srcw, srch, dw, dh;
+    uint32_t nalLen[ WARM_NALS ];
+} warmcache_head;
+
+typedef struct warmbuf_s {
+    uint8_t *data;
+    uint32_t len;
+    uint32_t cap;
+} warmbuf;
+
+typedef struct warmcache_s {
+    char *path;
+    char loaded; // read from the file rather than built from the live stream
+    char stale; // a live SPS or PPS differs from the one the decoder was opened with
+    int srcw, srch, dw, dh;
+    warmbuf nals[ WARM_NALS ];
+    warmbuf building; // IDR slices of the picture still coming in
+    uint64_t written; // now_msec of the last write; 0 before the first
+} warmcache;
+
+static void warmbuf__add( warmbuf *self, uint8_t *data, uint32_t len ) {
+    if( self->len + len > self->cap ) {
+        self->cap = ( self->len + len ) * 2;
+        self->data = realloc( self->data, self->cap );
+    }
+    memcpy( self->data + self->len, data, len );
+    self->len += len;
+}
+
+// Append a NAL with a 4 byte start code, whatever start code it came with
+static void warmbuf__add_nal( warmbuf *self, chunk *c ) {
+    int sc = startcode_len( (uint8_t *) c->data, c->size );
+    uint8_t code[4] = { 0, 0, 0, 1 };
+    warmbuf__add( self, code, 4 );
+    warmbuf__add( self, (uint8_t *) c->data + sc, c->size - sc );
+}
+
+// Whether buf holds the NAL of c, whatever start code each has
+static char warmbuf__same_nal( warmbuf *self, chunk *c ) {
+    int sc = startcode_len( (uint8_t *) c->data, c->size );
+    return self->len == 4 + c->size - sc && !memcmp( self->data + 4, c->data + sc, c->size - sc );
+}
+
+static uint32_t warmcache__sum( uint8_t *data, uint32_t len ) {
+    uint32_t hash = 2166136261u;
+    for( uint32_t i=0;i<len;i++ ) hash = ( hash ^ data[i] ) * 16777619u;
+    return hash;
+}
+
+warmcache *warmcache__new( char *path ) {
+    warmcache *self = calloc( sizeof( warmcache ), 1 );
+    self->path = strdup( path );
+    return self;
+}
+
+void warmcache__del( warmcache *self ) {
+    for( int i=0;i<WARM_NALS;i++ ) free( self->nals[i].data );
+    free( self->building.data );
+    free( self->path );
+    free( self );
+}
+
+// Why data does not hold a usable set of NALs for head; NULL when it does
+static char *warmcache__check( warmcache_head *head, uint8_t *data ) {
+    static const char types[ WARM_NALS ] = { 6, 7, 8, 5 };
+    uint32_t pos = 0;
+    for( int i=0;i<WARM_NALS;i++ ) {
+        uint32_t len = head->nalLen[i];
+        if( !len ) {
+            if( i == WARM_SPS || i == WARM_PPS ) return "no SPS or PPS";
+            continue;
+        }
+        uint8_t *nal = data + pos;
+        if( len < 5 || startcode_len( nal, len ) != 4 || ( nal[4] & 0x1F ) != types[i] ) return "NAL of the wrong type";
+        pos += len;
+    }
+    sps_info sps;
+    if( !sps__parse( data + head->nalLen[ WARM_SEI ], head->nalLen[ WARM_SPS ], &sps ) ) return "SPS does not parse";
+    if( sps.width != head->srcw || sps.height != head->srch ) return "SPS size does not match";
+    if( head->dw <= 0 || head->dh <= 0 ) return "no target size";
+    return NULL;
+}
+
+// Load the file at path. Returns 0 when it is missing or not valid.
+char warmcache__read( warmcache *self ) {
+    FILE *fh = fopen( self->path, "rb" );
+    if( !fh ) return 0;
+
+    char *err = NULL;
+    uint8_t *data = NULL;
+    warmcache_head head;
+    struct stat st;
+    uint64_t total = 0;
+    if( fread( &head, sizeof( head ), 1, fh ) != 1 ) err = "too short";
+    else if( memcmp( head.magic, WARMCACHE_MAGIC, 8 ) ) err = "not a cache file";
+    else if( head.version != WARMCACHE_VERSION ) err = "another version";
+    if( !err ) {
+        for( int i=0;i<WARM_NALS;i++ ) total += head.nalLen[i];
+        if( total != head.bytes || fstat( fileno( fh ), &st ) || (uint64_t) st.st_size != sizeof( head ) + total ) err = "size mismatch";
+    }
+    if( !err ) {
+        data = malloc( head.bytes );
+        if( fread( data, 1, head.bytes, fh ) != head.bytes ) err = "too short";
+        else if( warmcache__sum( data, head.bytes ) != head.sum ) err = "sum mismatch";
+        else err = warmcache__check( &head, data );
+    }
+    fclose( fh );
+    if( err ) {
+        fprintf(stderr, "Ignoring cache file %s; %s\n", self->path, err );
+        free( data );
+        return 0;
+    }
+
+    uint32_t pos = 0;
+    for( int i=0;i<WARM_NALS;i++ ) {
+        self->nals[i].len = 0;
+        warmbuf__add( &self->nals[i], data + pos, head.nalLen[i] );
+        pos += head.nalLen[i];
+    }
+    free( data );
+    self->srcw = head.srcw;
+    self->srch = head.srch;
+    self->dw = head.dw;
+    self->dh = head.dh;
+    self->loaded = 1;
+    return 1;
+}
+
+// Write through a temporary file so a crash mid write leaves the old file in place
+char warmcache__write( warmcache *self ) {
+    if( !self->srcw || !self->nals[ WARM_SPS ].len || !self->nals[ WARM_PPS ].len ) return 0;
+    warmcache_head head = { 0 };
+    memcpy( head.magic, WARMCACHE_MAGIC, 8 );
+    head.version = WARMCACHE_VERSION;
+    head.srcw = self->srcw;
+    head.srch = self->srch;
+    head.dw = self->dw;
+    head.dh = self->dh;
+    warmbuf all = { 0 };
+    for( int i=0;i<WARM_NALS;i++ ) {
+        head.nalLen[i] = self->nals[i].len;
+        if( self->nals[i].len ) warmbuf__add( &all, self->nals[i].data, self->nals[i].len );
+    }
+    head.bytes = all.len;
+    head.sum = warmcache__sum( all.data, all.len );
+
+    char tmp[310];
+    snprintf( tmp, 310, "%s.tmp", self->path );
+    FILE *fh = fopen( tmp, "wb" );
+    char ok = 0;
+    if( fh ) {
+        ok = fwrite( &head, sizeof( head ), 1, fh ) == 1 && fwrite( all.data, 1, all.len, fh ) == all.len;
+        ok = !fclose( fh ) && ok;
+    }
+    free( all.data );
+    if( !ok || rename( tmp, self->path ) ) {
+        fprintf(stderr, "Could not write cache file %s\n", self->path );
+        return 0;
+    }
+    self->written = now_msec();
+    return 1;
+}
+
+void warmcache__set_size( warmcache *self, int srcw, int srch, int dw, int dh ) {
+    self->srcw = srcw;
+    self->srch = srch;
+    self->dw = dw;
+    self->dh = dh;
+    if( !self->written && self->nals[ WARM_KEY ].len ) warmcache__write( self );
+}
+
+// The picture being built is whole; it becomes the cached keyframe
+static void warmcache__key_done( warmcache *self ) {
+    warmbuf done = self->building;
+    self->building = self->nals[ WARM_KEY ];
+    self->building.len = 0;
+    self->nals[ WARM_KEY ] = done;
+}
+
+// Tracker watch; keeps the latest headers and IDR picture of the stream
+void warmcache__watch( void *opaque, chunk *c ) {
+    warmcache *self = (warmcache *) opaque;
+    int type = c->easyType;
+    if( type == 5 && slice__first_mb( c ) ) {
+        if( self->building.len ) warmbuf__add_nal( &self->building, c );
+        return;
+    }
+    // Any other NAL ends the picture before it
+    if( self->building.len ) {
+        warmcache__key_done( self );
+        if( !self->written || now_msec() - self->written >= WARMCACHE_INTERVAL ) warmcache__write( self );
+    }
+    if( type == 5 ) warmbuf__add_nal( &self->building, c );
+    else if( type >= 6 && type <= 8 ) {
+        warmbuf *nal = &self->nals[ type == 6 ? WARM_SEI : type == 7 ? WARM_SPS : WARM_PPS ];
+        if( self->loaded && type != 6 && !warmbuf__same_nal( nal, c ) ) {
+            printf("Live %s differs from the cached one; dropping the cached keyframe\n", type == 7 ? "SPS" : "PPS" );
+            self->stale = 1;
+            self->nals[ WARM_KEY ].len = 0; // it goes with the old headers
+        }
+        nal->len = 0;
+        warmbuf__add_nal( nal, c );
+    }
+}
+
+// Write out what the stream left behind, including a keyframe that was its last picture
+void warmcache__finish( warmcache *self ) {
+    if( self->building.len ) warmcache__key_done( self );
+    warmcache__write( self );
+}
+
+static void tracker__add_copy( chunk_tracker *tracker, warmbuf *nal ) {
+    chunk *c = calloc( sizeof( chunk ), 1 );
+    c->data = malloc( nal->len + CHUNK_PADDING );
+    memcpy( c->data, nal->data, nal->len );
+    memset( c->data + nal->len, 0, CHUNK_PADDING );
+    c->size = nal->len;
+    c->pad = CHUNK_PADDING;
+    c->whole = 1;
+    c->type = c->data[4];
+    c->dtype = 0;
+    chunk__dump( c );
+    tracker__add_chunk( tracker, c );
+}
+
+// Queue the cached headers and keyframe as if they had just been received. The keyframe goes
+// as one chunk holding all its slices. Returns 1 when a keyframe was queued.
+int warmcache__queue( warmcache *self, chunk_tracker *tracker ) {
+    for( int i=0;i<WARM_NALS;i++ ) {
+        if( self->nals[i].len ) tracker__add_copy( tracker, &self->nals[i] );
+    }
+    return self->nals[ WARM_KEY ].len ? 1 : 0;
+}
+#endif